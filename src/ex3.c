@@ -1,3 +1,4 @@
+#define _GNU_SOURCE // for prlimit
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -11,20 +12,100 @@
 #include <sys/types.h> // for pid_t
 #include <fcntl.h> // for open function
 #include <pthread.h> // for pthread_create
+#include <sched.h> // for sched_setaffinity and sched_setscheduler
+#include <sys/syscall.h> // for ioprio_set and perf_event_open, glibc has no wrapper
+#include <linux/perf_event.h> // for --perf-counters
+#include <sys/stat.h> // for mkdir
+#include <limits.h> // for PATH_MAX
+#include <poll.h> // for waiting on several pipeline stages at once
+#include <stdarg.h> // for log_record
+#include <stdatomic.h> // for the exec_times ring indexes
+#include <time.h> // for clock_gettime
+#include <math.h> // for sqrt
+#include <sys/mman.h> // for mmap of exec_times in --resume-stats
+#include <sys/file.h> // for flock while rotating exec_times
+#include <dirent.h> // for finding rotated exec_times segments
+#include <zlib.h> // for compressing rotated exec_times segments
+#include "ex3_log.h" // binary exec_times format, shared with ex3-stats
+#include "ex3_histogram.h" // latency buckets, shared with ex3-stats
+#include "ex3_shm.h" // live counters, read by ex3-top
 
 #define MAX_SIZE 1025
 #define MAX_ARG 7 // command + 6 arguments
 #define MAX_DANG 1000
 
 // Resource limit related defines
-#define BYTES_IN_KB 1024
-#define BYTES_IN_MB (1024 * 1024)
-#define BYTES_IN_GB (1024 * 1024 * 1024)
+#define BYTES_IN_KB 1024ULL
+#define BYTES_IN_MB (1024ULL * 1024)
+#define BYTES_IN_GB (1024ULL * 1024 * 1024)
+#define BYTES_IN_TB (1024ULL * 1024 * 1024 * 1024)
+#define BYTES_IN_PB (1024ULL * 1024 * 1024 * 1024 * 1024)
 
 #define MAX_BG_PROCESSES 100
 
+#define MAX_STAGES 16 // commands in one pipeline
+
+#define TEE_BUFFER_SIZE (256 * 1024) // my_tee moves data in chunks of this size
+#define CHANNEL_DEPTH 4 // buffers queued between two adjacent builtin stages
+
 #define MAX_MATRICES 20 
 
+#define MAX_PROFILES 100
+#define MAX_PROFILE_LIMITS 8
+
+#define LOG_RING_SIZE 256 // exec_times records waiting for the logger thread, a power of two
+#define LOG_RECORD_SIZE (MAX_SIZE * 2) // longer records are cut
+#define LOG_BATCH_SIZE (64 * 1024) // the logger writes up to this much per write(2)
+#define LOG_FLUSH_INTERVAL_MS 100 // default for --log-interval, the longest a record waits
+#define LOG_FULL_WAIT_MS 200 // how long a push waits for room in a full ring before dropping the record
+#define BINLOG_KNOWN_IDS 4096 // command ids this shell remembers having written to .names, a power of two
+// phases of one turn of the REPL timed by "profile on", in the order they happen
+#define PROFILE_PROMPT 0 // print_prompt
+#define PROFILE_READ 1 // waiting for and reading the line
+#define PROFILE_SPLIT 2 // everything up to and including split_and_validate
+#define PROFILE_DANGER 3 // check_dangerous_command
+#define PROFILE_SPAWN 4 // redirections and fork, until the parent goes on
+#define PROFILE_RUN 5 // the child, fork returning to wait4 returning
+#define PROFILE_REAP 6 // exit status and failure reporting
+#define PROFILE_STATS 7 // statistics and queuing the exec_times records
+#define PROFILE_PHASES 8
+
+// one predictable branch while profiling is off
+#define PROFILE_START() do { if (profile_enabled) profile_start(); } while (0)
+#define PROFILE_POINT(phase) do { if (profile_enabled) profile_point(phase); } while (0)
+
+#define PERF_EVENTS 5 // counters per command with --perf-counters, hardware or their software stand-ins
+#define PERF_DETAIL_SIZE 256
+
+#define ROTATE_KEEP_DEFAULT 5 // rotated exec_times segments kept by default
+#define ROTATE_GRACE_MS 1000 // time other shells get to notice a rotation before the old segment is compressed
+
+#define STATS_WINDOW_MAX 65536 // commands the sliding window of the stats can hold
+#define COMMAND_STATS_MAX 128 // command names with stats of their own, the least recently run is evicted
+#define COMMAND_STATS_BUCKETS 256 // hash chains of the per-command stats, a power of two
+#define COMMAND_NAME_SIZE 64 // longer command names are cut
+#define STATS_TOP 10 // commands "stats" lists
+#define STATS_CHECKPOINT_SUFFIX ".stats" // --resume-stats keeps its checkpoint next to exec_times
+#define STATS_CHECKPOINT_MAGIC 0x3154415453335845ULL // "EX3STAT1" little endian
+#define STATS_CHECKPOINT_VERSION 2
+#define STATS_CHECKPOINT_TAIL 64 // exec_times bytes kept to recognise the file the checkpoint belongs to
+
+#define MAX_REDIRECTS 8 // redirections on one command
+#define MAX_REDIRECT_FD 1023
+
+// kinds of redirection
+#define REDIRECT_READ 0 // [n]<file
+#define REDIRECT_TRUNCATE 1 // [n]>file
+#define REDIRECT_APPEND 2 // [n]>>file
+#define REDIRECT_DUP 3 // [n]>&m and [n]<&m
+
+// I/O priority encoding of ioprio_set(2)
+#define IOPRIO_CLASS_SHIFT 13
+#define IOPRIO_CLASS_RT 1
+#define IOPRIO_CLASS_BE 2
+#define IOPRIO_CLASS_IDLE 3
+#define IOPRIO_WHO_PROCESS 1
+
 struct matrix
 {
     int rows;
@@ -33,9 +114,174 @@ struct matrix
     int* data;
 };
 
+struct bg_process 
+{
+    pid_t pid;
+    struct timeval start_time;
+    char command[MAX_SIZE];
+    unsigned long long last_cpu_ticks; // utime + stime at the last jobs -v sample
+    struct timeval last_sample; // when last_cpu_ticks was taken, zero if never sampled
+    int perf_fds[PERF_EVENTS]; // --perf-counters of the job, -1 if not counted
+};
+
+// One perf_event_open(2) event counted for every command with --perf-counters
+struct perf_counter
+{
+    uint32_t type;
+    uint64_t config;
+    const char* name;
+};
+
+// Scheduling settings for launched commands, each field only applies when its has_ flag is set
+struct sched_profile
+{
+    int has_cpus;
+    cpu_set_t cpus;
+    int has_nice;
+    int nice;
+    int has_policy;
+    int policy; // SCHED_OTHER, SCHED_BATCH or SCHED_IDLE
+    int has_ioprio;
+    int ioprio; // class << IOPRIO_CLASS_SHIFT | level
+    int reset_cpus; // cpus=all given: a "sched run" override drops the session's cpus
+    int reset_ioprio; // ioprio=none given, likewise for the session's ioprio
+};
+
+// One redirection of a command, applied in the child just before exec
+struct redirect
+{
+    int type; // REDIRECT_*
+    int fd; // the descriptor being redirected
+    int source_fd; // REDIRECT_DUP: fd becomes a copy of this one
+    char path[MAX_SIZE]; // every other type opens this file
+};
+
+// The redirection table of one command, in the order they were written
+struct redirections
+{
+    int count;
+    struct redirect entries[MAX_REDIRECTS];
+};
+
+// Buffers shared by the builtin stages of one pipeline. A filled buffer is handed from stage to
+// stage and only comes back here once the last one is done with it, the data is never copied.
+// lock also guards every stage_channel of the pipeline.
+struct buffer_pool
+{
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    char* free_buffers[MAX_STAGES * (CHANNEL_DEPTH + 1)]; // enough for every channel full and every stage holding one
+    int free_count;
+};
+
+// Connects two adjacent builtin stages in place of a pipe
+struct stage_channel
+{
+    struct buffer_pool* pool;
+    char* buffers[CHANNEL_DEPTH];
+    size_t lengths[CHANNEL_DEPTH];
+    int head;
+    int count;
+    int closed; // the writing stage is done
+    int abandoned; // the reading stage is done, whatever is sent from now on is dropped
+};
+
+// A builtin pipeline stage run by a thread of the shell instead of a forked child
+struct builtin_stage
+{
+    char** command;
+    int arg_count;
+    const struct redirections* redirect;
+    int in_fd; // -1 when reading from in_channel
+    int out_fd; // -1 when writing to out_channel
+    int err_fd;
+    int close_in; // in_fd/out_fd are pipe ends owned by this stage
+    int close_out;
+    struct stage_channel* in_channel;
+    struct stage_channel* out_channel;
+    int in_shell; // 0 when my_tee runs in a forked child
+    int status; // wait(2) style, so the stage is recorded like a process
+    struct timeval end;
+    struct rusage usage;
+    pid_t tid; // the thread that ran it, its lane in a --trace
+    char note[64]; // what my_tee moved and how fast, added to the stage's exec_times detail
+};
+
+// A named set of limits from the --limits file, applied to every command with that name
+struct limit_profile
+{
+    char name[MAX_SIZE];
+    int count;
+    int resources[MAX_PROFILE_LIMITS];
+    struct rlimit limits[MAX_PROFILE_LIMITS];
+};
+
+// Durations of finished commands: one increment per command, percentiles from a scan of the
+// fixed number of buckets, and a sample can be taken out again for the sliding window
+struct latency_histogram
+{
+    unsigned int buckets[EX3_HIST_BUCKETS];
+    unsigned long count;
+    double sum; // seconds
+    double sum_squares;
+};
+
+struct window_sample
+{
+    double runtime;
+    double finished; // CLOCK_MONOTONIC seconds
+};
+
+// Stats of one command name (argv[0]), failed runs included in the times.
+// Entries are chained by hash and kept on a list from most to least recently run.
+struct command_stats
+{
+    char name[COMMAND_NAME_SIZE];
+    uint64_t id; // ex3_command_id of name
+    unsigned long count;
+    unsigned long failures;
+    double total;
+    double min;
+    double max;
+    struct latency_histogram latency;
+    int hash_next; // -1 ends a chain
+    int newer; // -1 for the most recently run
+    int older; // -1 for the least recently run
+};
+
+// --resume-stats: the statistics of exec_times up to offset, so a restart only parses what came after.
+// Written whole by the shell that wrote it, size guards against a build with another layout.
+struct stats_checkpoint
+{
+    uint64_t magic;
+    uint32_t version;
+    uint32_t size; // sizeof(struct stats_checkpoint)
+    uint64_t offset;
+    uint64_t device; // identity of the exec_times file, which rotation replaces
+    uint64_t inode;
+    uint64_t opened_us; // taken before the file was opened, it is rotated no earlier than this
+    uint32_t tail_length;
+    char tail[STATS_CHECKPOINT_TAIL]; // the bytes before offset, a replaced or truncated exec_times won't match
+    int cmd;
+    double total_time;
+    double min_time;
+    double max_time;
+    struct latency_histogram all_latency;
+    int command_table_count;
+    int command_newest;
+    int command_oldest;
+    int command_chains[COMMAND_STATS_BUCKETS];
+    struct command_stats command_table[COMMAND_STATS_MAX];
+};
+
 int space_error(char str[]);
 void split_string(char* input, char* result[], int* count, int max_arg);
 void input_arg_check(int argc);
+void parse_options(int argc, char* argv[]);
+int load_limit_profiles(const char* filename);
+void apply_limit_profile(const char* command_name, char* overrides[], int override_count);
+void print_limit_profiles(void);
+const char* rlimit_name(int resource_code);
 FILE* open_file(char* filename, char* mode);
 int load_dangerous_commands(FILE* dangerous_commands, char* dng_cmds[]);
 int split_and_validate(char* input, char* original_input, char* command[], int rlimit_flag);
@@ -43,22 +289,149 @@ void free_resources(char* command[], int arg_count, char* dng_cmds[], int dng_co
 int check_dangerous_command(char* original_input, char* command[], int arg_count);
 double execute_command(char* command[], char* original_input);
 void update_timing_stats(double runtime, const char* command_name);
-double handle_pipe(char* input, char* original_input, int pipe_index);
-void handle_mytee(char * command[], int right_arg_count);
+void update_timing_stats_detail(double runtime, const char* command_name, const char* detail);
+void update_timing_stats_result(double runtime, const char* command_name, const char* detail, int status, const struct rusage* usage);
+void print_prompt(void);
+void latency_record(double runtime);
+void latency_add(struct latency_histogram* histogram, double runtime, int sign);
+double latency_percentile(const struct latency_histogram* histogram, double fraction, double max);
+double latency_stddev(const struct latency_histogram* histogram);
+void window_expire(double now);
+double monotonic_seconds(void);
+int set_stats_window(const char* arg);
+void handle_stats(char* command[], int arg_count);
+void print_latency(const char* label, const struct latency_histogram* histogram, double max);
+void update_failure_stats(const char* command_name, double runtime, int status, const struct rusage* usage);
+void command_stats_record(const char* command_name, double runtime, int failed);
+void command_stats_add(const char* command_name, double runtime, int failed);
+struct command_stats* command_stats_find(const char* name, int create);
+void command_stats_unlink(int index);
+void print_command_stats(const struct command_stats* stats);
+int resume_stats(const char* path);
+int load_stats_checkpoint(const char* path, struct stats_checkpoint* checkpoint);
+int stats_checkpoint_matches(const struct stats_checkpoint* checkpoint, const char* data, const struct stat* st);
+void restore_stats_checkpoint(const struct stats_checkpoint* checkpoint);
+void reset_stats(void);
+void save_stats_checkpoint(const char* path, const char* data, size_t offset, const struct stat* st, uint64_t opened_us, struct stats_checkpoint* checkpoint);
+void resume_stats_line(const char* line, size_t len);
+int resume_stats_segment(const char* path, uint64_t skip, const char* tail, size_t tail_length);
+int resume_stats_rotated(const char* path, const struct stats_checkpoint* checkpoint);
+void format_segment_stamp(const struct timeval* when, char* stamp, size_t size);
+int list_log_segments(const char* path, char*** segments);
+int compare_segments(const void* a, const void* b);
+void log_check_rotation(void);
+void log_rotate(void);
+void log_reopen(void);
+time_t log_segment_birth(int fd);
+void* compress_segments(void* arg);
+void shm_open_stats(void);
+void shm_close_stats(void);
+void shm_unlink_stats(void);
+void shm_begin(void);
+void shm_end(void);
+void shm_publish_prompt(double p50, double p95, double p99);
+void shm_publish_command(const char* input);
+uint64_t realtime_us(void);
+void profile_start(void);
+void perf_probe(void);
+int perf_event_open(uint32_t type, uint64_t config, pid_t pid);
+int perf_gate_open(int gate[2]);
+void perf_gate_wait(int gate[2]);
+void perf_attach(pid_t pid, int gate[2], int fds[]);
+void perf_close(int fds[]);
+void perf_read(int fds[], char* detail, size_t size);
+void trace_open(const char* path);
+void trace_close(void);
+void trace_span(const char* category, const char* name, int tid, uint64_t start_us, uint64_t end_us, const char* args);
+void trace_stages(char stage_input[][MAX_SIZE], int count, const pid_t lane[], struct timeval stage_start[], struct timeval stage_end[]);
+void json_escape(char* out, size_t size, const char* in);
+uint64_t timeval_us(const struct timeval* tv);
+void profile_point(int phase);
+void handle_profile(char* command[], int arg_count);
+int compress_segment(const char* segment);
+void remove_old_segments(const char* path);
+int wait_pipeline_stages(pid_t stage_pid[], int count, int status[], struct rusage usage[], struct timeval end[]);
+void describe_stage(int index, int count, int status, const struct rusage* usage, char* buffer, size_t size);
+double handle_pipe(char* input, char* original_input);
+double handle_fanout(char* input, char* original_input);
+int split_stages(char* input, const char* separator, char stages[][MAX_SIZE], int max_stages);
+int prepare_stages(char stage_input[][MAX_SIZE], int count, char* original_input, char* stage_command[][MAX_ARG + 1], int stage_arg_count[], struct redirections stage_redirect[]);
+void free_stages(char* stage_command[][MAX_ARG + 1], int stage_arg_count[], int count);
+void exec_stage(char* command[], int arg_count, const struct redirections* redirect);
+int record_stages(char stage_input[][MAX_SIZE], int count, pid_t stage_pid[], int status[], struct rusage usage[], struct timeval stage_start[], struct timeval stage_end[], const double blocked[], int writers, const char* notes[]);
+int handle_mytee(char * command[], int right_arg_count);
+int run_mytee(struct builtin_stage* stage);
+int is_builtin_stage(const char* name);
+void* run_builtin_stage(void* arg);
+int resolve_stage_redirections(struct builtin_stage* stage, int opened[], int* opened_count);
+int tee_channel(struct builtin_stage* stage, int out_fds[], int out_count, unsigned long long* total_bytes);
+char* pool_get(struct buffer_pool* pool);
+void pool_put(struct buffer_pool* pool, char* buffer);
+void pool_put_locked(struct buffer_pool* pool, char* buffer);
+void pool_destroy(struct buffer_pool* pool);
+int channel_send(struct stage_channel* channel, char* buffer, size_t len);
+size_t channel_receive(struct stage_channel* channel, char** buffer);
+void channel_close(struct stage_channel* channel);
+void channel_abandon(struct stage_channel* channel);
+int tee_fanout(int in_fd, int out_fds[], int out_count, unsigned long long* total_bytes, double blocked[]);
+int write_all(int fd, const char* buffer, size_t len);
+int tee_fanout_zero_copy(int in_fd, int out_fds[], int out_count, unsigned long long* total_bytes, double blocked[]);
+int drain_pipe_to(int pipe_fd, int out_fd, size_t len, char* buffer);
+int handle_pipesize(const char* arg);
+int create_pipe(int fds[2]);
 int handle_rlimit(char* command[], int arg_count, FILE* exec_times, int* cmd, double* total_time, double* last_cmd_time, double* avg_time, double* min_time, double* max_time);
-int set_rlimit(int resource_code, int soft_limit, int hard_limit);
-int size_value(const char* value_str);
+int set_rlimit(int resource_code, rlim_t soft_limit, rlim_t hard_limit);
+int size_value(const char* value_str, rlim_t* value);
+int parse_rlimit_arg(const char* arg, int* resource_code, struct rlimit* limit);
+void print_rlimit_arg_error(const char* arg, int result);
+int parse_cpuquota(const char* arg, double* percent);
+void format_limit(rlim_t value, char* buffer, size_t size);
+pid_t resolve_job_pid(const char* spec);
+int print_rlimits(pid_t pid);
+int is_cgroup_limit(const char* arg);
+int find_cgroup_root(char* root, size_t size);
+int prepare_cgroup_root(char* root, size_t size);
+int cgroup_controllers_enabled(const char* dir);
+int write_cgroup_file(const char* dir, const char* file, const char* value);
+void cgroup_limit_value(rlim_t value, char* buffer, size_t size);
+int create_command_cgroup(char* command[], int first, int last, char* cg_dir, size_t size);
+void report_command_cgroup(const char* cg_dir);
 void handle_sigcpu(int signo);
 void handle_sigfsz(int signo);
 void handle_sigmem(int signo);
 void handle_signof(int signo);
 void handle_sigchild(int signo);
+void handle_sigterm(int signo);
+void log_start(int fd);
+void log_record(const char* format, ...);
+void log_wake(void);
+int log_wait_for_room(atomic_ulong* tail_index, unsigned long head, unsigned long* tail, int wait);
+void* log_thread_main(void* arg);
+void log_drain(void);
+void log_drain_text(char ring[][LOG_RECORD_SIZE], atomic_ulong* head_index, atomic_ulong* tail_index, int fd, const char* what);
+void log_shutdown(void);
+void log_sync(void);
+int binlog_open(const char* path);
+int binlog_write_header(int fd);
+void binlog_rotate(const char* stamp);
+void binlog_reopen(void);
+void binlog_record(const char* command_name, double runtime, int status, const struct rusage* usage);
+void binlog_intern(uint64_t id, const char* command_name);
 int check_process_status(int status, pid_t pid, const char* cmd_name, FILE* exec_file, double runtime, int is_background);
-int handle_stderr_redirection(char* command[]); 
+int parse_redirections(char* command[], int arg_count, struct redirections* redirect);
+int parse_redirect_word(const char* word, struct redirect* entry);
+int apply_redirections(const struct redirections* redirect);
 void handle_mcalc(char* command[], int arg_count);
 int mcalc_format_check(char* command[], int arg_count, struct matrix* matrices[], int* matrix_count,int* operation);
 void* matrices_calculation(void* arg);
 void free_matrices(struct matrix* matrices[], int matrix_count);
+void handle_jobs(char* command[], int arg_count);
+int sample_bg_process(struct bg_process* proc, double* cpu_percent, long* rss_kb, unsigned long long* io_read, unsigned long long* io_write, int* threads);
+void handle_sched(char* command[], int arg_count);
+int parse_sched_arg(const char* arg, struct sched_profile* profile);
+int strip_sched_run(char* input, struct sched_profile* profile);
+void apply_sched_profile(int background);
+void print_sched_profile(const char* name, const struct sched_profile* profile);
 
 struct thread_data
 {
@@ -66,13 +439,6 @@ struct thread_data
     int operation;
 };
 
-struct bg_process 
-{
-    pid_t pid;
-    struct timeval start_time;
-    char command[MAX_SIZE];
-};
-
 struct bg_process bg_processes[MAX_BG_PROCESSES];
 int bg_count = 0;
 FILE* global_exec_times = NULL; 
@@ -85,12 +451,144 @@ int dangerous_cmd_warning = 0;
 char* dng_cmds[MAX_DANG];  // Global array for dangerous commands
 int dng_count = 0;         // Global counter for dangerous commands
 
+// fg_sched applies to foreground commands and pipelines, bg_sched to & jobs,
+// command_sched holds the "sched run" overrides of the line being executed
+struct sched_profile fg_sched;
+struct sched_profile bg_sched = { .has_policy = 1, .policy = SCHED_BATCH, .has_nice = 1, .nice = 10,
+                                  .has_ioprio = 1, .ioprio = (IOPRIO_CLASS_BE << IOPRIO_CLASS_SHIFT) | 7 };
+struct sched_profile command_sched;
+
+// rlimit set backend: 0 = setrlimit only, 1 = per-command cgroup v2 when the subtree is writable
+int rlimit_backend_cgroup = 0;
+int cgroup_counter = 0; // makes per-command cgroup names unique within this shell
+#define CGROUP_SHELL_LEAF "ex3-shell" // where the shell moves to so its own cgroup can enable controllers
+#define CGROUP_CONTROLLERS "+memory +cpu +pids"
+
+// capacity for pipes between stages, set with pipesize=<size>; 0 keeps the kernel default
+long pipe_size = 0;
+
+// exec_times records go through a single-producer ring to a logger thread that writes them in
+// batches, so a slow disk never delays the prompt. Only the main thread pushes (handle_sigchild
+// runs on it as well, SIGCHLD is blocked around a push) and only the logger thread pops.
+char log_ring[LOG_RING_SIZE][LOG_RECORD_SIZE];
+atomic_ulong log_head; // next slot the shell fills
+atomic_ulong log_tail; // next slot the logger writes out
+atomic_ulong log_dropped; // records lost because the ring was full
+atomic_ulong log_truncated; // records cut at LOG_RECORD_SIZE
+atomic_int log_stop;
+volatile sig_atomic_t log_terminate; // set by SIGTERM, the logger flushes and ends the shell
+volatile sig_atomic_t in_sigchild; // handle_sigchild is running, a push into a full ring must not wait
+int log_fd = -1;
+int log_wake_fds[2] = { -1, -1 };
+int log_interval_ms = LOG_FLUSH_INTERVAL_MS;
+int log_field_pid = 0; // --log-fields=pid,seq add " [pid N, seq N]" to every text record
+int log_field_seq = 0;
+unsigned long log_seq = 0; // records this shell produced, dropped ones included
+pthread_t log_thread;
+pid_t log_owner = 0; // the shell's pid while the logger runs, forked children leave it alone
+
+// --rotate-size/--rotate-age: the logger renames exec_times to <path>.<UTC time> and starts a new
+// file; a thread of its own gzips the old segment and removes all but the newest rotate_keep
+char log_path[PATH_MAX];
+unsigned long long rotate_size = 0; // 0 = no size limit
+long rotate_age = 0; // seconds, 0 = no age limit
+int rotate_keep = ROTATE_KEEP_DEFAULT;
+time_t log_segment_start;
+pthread_t compress_thread;
+int compress_started = 0; // compress_thread has to be joined; logger thread and log_shutdown only
+atomic_int compress_active; // a compressor is running or about to
+atomic_int compress_pending; // a segment was rotated since the compressor last looked
+
+// --binlog: fixed-size records queued for the same logger thread in a ring of their own
+struct ex3_binlog_record binlog_ring[LOG_RING_SIZE];
+atomic_ulong binlog_head;
+atomic_ulong binlog_tail;
+int binlog_fd = -1;
+int binlog_names_fd = -1;
+char binlog_path[PATH_MAX]; // rotated along with exec_times, .names is kept for all segments
+uint64_t binlog_known_ids[BINLOG_KNOWN_IDS]; // open addressing, 0 is an empty slot
+char binlog_name_ring[LOG_RING_SIZE][LOG_RECORD_SIZE]; // .names lines, written by the logger too
+atomic_ulong binlog_name_head;
+atomic_ulong binlog_name_tail;
+
+// how the last foreground command of execute_command ended, for its binlog record
+int last_command_status = 0;
+struct rusage last_command_usage;
+char last_command_counters[PERF_DETAIL_SIZE]; // its --perf-counters, "" when not counted
+
+// --perf-counters: perf_event_open counters attached to every command at exec and inherited by its
+// descendants, written to its exec_times record. perf_probe picks the hardware events or, where
+// the kernel or the VM does not allow them, software ones.
+int perf_enabled = 0;
+int perf_user_only = 0; // perf_event_paranoid only lets us count user space
+const struct perf_counter* perf_events = NULL;
+const struct perf_counter perf_hardware[PERF_EVENTS] = {
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES, "cycles" },
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS, "instructions" },
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES, "cache-misses" },
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES, "branch-misses" },
+    { PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS, "page-faults" },
+};
+const struct perf_counter perf_software[PERF_EVENTS] = {
+    { PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK, "task-clock" },
+    { PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES, "context-switches" },
+    { PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CPU_MIGRATIONS, "cpu-migrations" },
+    { PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS, "page-faults" },
+    { PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS_MAJ, "major-faults" },
+};
+
+// limit profiles loaded once at startup from --limits=<file>
+struct limit_profile limit_profiles[MAX_PROFILES];
+int profile_count = 0;
+
 double last_cmd_time = 0;
 double total_time = 0;
 double avg_time = 0;
 double min_time = 0;
 double max_time = 0;
 
+// latency distribution since the shell started, and of the last window_limit commands or
+// window_seconds seconds when a window is set (the prompt then shows the window's)
+struct latency_histogram all_latency;
+struct latency_histogram window_latency;
+struct window_sample window_samples[STATS_WINDOW_MAX]; // ring, oldest at window_first
+int window_first = 0;
+int window_count = 0;
+int window_limit = 0;
+double window_seconds = 0;
+
+// per-command-name stats, a fixed table with LRU eviction
+struct command_stats command_table[COMMAND_STATS_MAX];
+int command_chains[COMMAND_STATS_BUCKETS]; // first entry of each hash chain, -1 when empty (set up in main)
+int command_table_count = 0;
+int command_newest = -1;
+int command_oldest = -1;
+
+int resume_stats_flag = 0; // --resume-stats
+
+// /dev/shm/ex3-<pid> for ex3-top, off with --no-shm. Only the main thread writes it; a publish
+// from handle_sigchild that would interrupt one from the main loop is left to the next prompt.
+struct ex3_shm_stats* shm_stats = NULL;
+int shm_enabled = 1;
+pid_t shm_owner = 0;
+volatile sig_atomic_t shm_writing = 0;
+
+// --trace=<path>: Chrome/Perfetto trace-event JSON of commands, stages, jobs and mcalc. Every thread
+// may add events (handle_sigchild too), each goes out in one write under trace_lock.
+int trace_fd = -1;
+pid_t trace_owner = 0;
+pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// "profile on": time spent in each phase of the REPL. A phase is the time from the previous point.
+// A turn is only counted once it went through every phase in order, i.e. ran an external command
+// in the foreground, so all phases are averaged over the same turns and their means add up.
+int profile_enabled = 0;
+struct latency_histogram profile_phases[PROFILE_PHASES];
+double profile_turn[PROFILE_PHASES]; // the phases of the current turn so far
+double profile_previous = 0;
+int profile_last_phase = PROFILE_PHASES; // nothing is counted until the next profile_start
+const char* profile_names[PROFILE_PHASES] = { "prompt", "read", "split", "dangerous", "spawn", "run (child)", "reap", "stats" };
+
 int main(int argc, char* argv[])
 {
     //signal handlers
@@ -100,13 +598,28 @@ int main(int argc, char* argv[])
     signal(SIGUSR1, handle_signof); // open files - using SIGUSR1 as a custom signal
     signal(SIGCHLD, handle_sigchild); //SIGCHLD handler for background processes
 
+    struct sigaction term_action;
+    memset(&term_action, 0, sizeof(term_action));
+    term_action.sa_handler = handle_sigterm; // flush exec_times before going down
+    term_action.sa_flags = SA_RESTART;
+    sigaction(SIGTERM, &term_action, NULL);
+
+    memset(command_chains, -1, sizeof(command_chains));
+
     //check for having two files as input
     input_arg_check(argc);
+    parse_options(argc, argv);
 
     //open files
     FILE* dangerous_commands = open_file(argv[1], "r");
     FILE* exec_times = open_file(argv[2], "a");
     global_exec_times = exec_times; // assigns a local pointer to the global pointer
+    snprintf(log_path, sizeof(log_path), "%s", argv[2]);
+    if (resume_stats_flag)
+        resume_stats(argv[2]);
+    log_start(fileno(exec_times));
+    if (shm_enabled)
+        shm_open_stats();
 
     //load dangerous commands
     dng_count = load_dangerous_commands(dangerous_commands, dng_cmds);
@@ -116,8 +629,9 @@ int main(int argc, char* argv[])
     // the mini-shell
     while (1) 
     {
-        printf("#cmd:%d|#dangerous_cmd_blocked:%d|last_cmd_time:%.5f|avg_time:%.5f|min_time:%.5f|max_time:%.5f>>"
-                ,cmd,dangerous_cmd_blocked,last_cmd_time,avg_time,min_time,max_time);
+        PROFILE_START();
+        print_prompt();
+        PROFILE_POINT(PROFILE_PROMPT);
 
         char input[MAX_SIZE]; //input string
         char original_input[MAX_SIZE]; //to have the original after using splitting
@@ -127,18 +641,36 @@ int main(int argc, char* argv[])
         //getting input
         if (fgets(input, MAX_SIZE, stdin) == NULL) 
         {
-            free_resources(command,MAX_ARG, dng_cmds, dng_count);
+            free_resources(NULL, 0, dng_cmds, dng_count); // command holds nothing of this line yet
             break;
         }
+        PROFILE_POINT(PROFILE_READ);
 
         input[strcspn(input, "\n")] = 0; //remove newline character after using fgets and avoiding execvp error
+
+        // "sched run key=value ... command" - keep the overrides aside and run the rest as a normal line
+        memset(&command_sched, 0, sizeof(command_sched));
+        if (strncmp(input, "sched run ", 10) == 0 && strip_sched_run(input, &command_sched) == -1)
+        {
+            printf("ERR\n");
+            continue;
+        }
+
         strcpy(original_input, input);
+        shm_publish_command(original_input);
 
         //check for rlimit
         int rlimit_set_flag = 0;
         if (strncmp(input, "rlimit set", 10) == 0)
             rlimit_set_flag = 1;
 
+        //check for fan-out "producer |> consumer , consumer ..."
+        if (strstr(input, " |> ") != NULL)
+        {
+            handle_fanout(input, original_input);
+            continue;
+        }
+
         //check for pipe
         int flag_pipe = 0; //not a fucntion because we only want to check for one pipe
         int pipe_index;
@@ -157,25 +689,8 @@ int main(int argc, char* argv[])
          //handle pipe
         if (flag_pipe == 1)
         {
-            double runtime = handle_pipe(input, original_input, pipe_index);
-
-            //not using the timing fucntion because it has special timing for pipe
-            if (runtime >= 0) // Both commands succeeded
-            {
-                cmd += 2;  // Both commands were valid and ran
-                total_time += runtime;
-                last_cmd_time = runtime / 2;  // Average time per command
-                avg_time = total_time / cmd;
-
-                double per_cmd_time = runtime / 2;  // Split runtime between the two commands
-                if (per_cmd_time > max_time)
-                    max_time = per_cmd_time;
-
-                if (per_cmd_time < min_time || min_time == 0)
-                {
-                    min_time = per_cmd_time;
-                }
-            }
+            // every stage updates the statistics with its own time inside handle_pipe
+            handle_pipe(input, original_input);
 
             continue; // Skip the regular command processing
         }
@@ -190,6 +705,7 @@ int main(int argc, char* argv[])
         {
             arg_count = split_and_validate(input, original_input, command,0);
         }
+        PROFILE_POINT(PROFILE_SPLIT);
 
 
         // Error in parsing input
@@ -227,6 +743,41 @@ int main(int argc, char* argv[])
         }
 
 
+        if (arg_count == 1 && strncmp(command[0], "pipesize=", 9) == 0)
+        {
+            handle_pipesize(command[0] + 9);
+            free_resources(command, arg_count, NULL, 0);
+            continue;
+        }
+
+        if (strcmp(command[0], "sched") == 0)
+        {
+            handle_sched(command, arg_count);
+            free_resources(command, arg_count, NULL, 0);
+            continue;
+        }
+
+        if (strcmp(command[0], "jobs") == 0)
+        {
+            handle_jobs(command, arg_count);
+            free_resources(command, arg_count, NULL, 0);
+            continue;
+        }
+
+        if (strcmp(command[0], "stats") == 0)
+        {
+            handle_stats(command, arg_count);
+            free_resources(command, arg_count, NULL, 0);
+            continue;
+        }
+
+        if (strcmp(command[0], "profile") == 0)
+        {
+            handle_profile(command, arg_count);
+            free_resources(command, arg_count, NULL, 0);
+            continue;
+        }
+
         if (strcmp(command[0], "done") == 0) //checking for done - end of terminal
         {
             printf("%d\n", dangerous_cmd_blocked);
@@ -234,11 +785,15 @@ int main(int argc, char* argv[])
             // Free all resources
             free_resources(command, arg_count, dng_cmds, dng_count);
 
+            log_shutdown(); // every record is on disk before we exit
+            if (resume_stats_flag)
+                resume_stats(argv[2]); // checkpoint what this session added
             fclose(exec_times);
             exit(0);
         }
 
         int danger_status = check_dangerous_command(original_input, command, arg_count);
+        PROFILE_POINT(PROFILE_DANGER);
 
         if (danger_status == 1) // Dangerous command detected
         {
@@ -249,8 +804,10 @@ int main(int argc, char* argv[])
 
         if (runtime >= 0) // Command executed successfully
         {
-            update_timing_stats(runtime, original_input);
+            update_timing_stats_result(runtime, original_input, last_command_counters[0] != '\0' ? last_command_counters : NULL,
+                                       last_command_status, &last_command_usage);
         }
+        PROFILE_POINT(PROFILE_STATS);
 
         for (int i = 0; i < arg_count; i++) 
         {
@@ -261,6 +818,9 @@ int main(int argc, char* argv[])
         }
     }
 
+    log_shutdown();
+    if (resume_stats_flag)
+        resume_stats(argv[2]);
     fclose(exec_times);
     return 0;
 }
@@ -274,6 +834,107 @@ void input_arg_check(int argc)
     }
 }
 
+// Optional settings after the two files, e.g. --limits=profiles.txt
+void parse_options(int argc, char* argv[])
+{
+    for (int i = 3; i < argc; i++)
+    {
+        if (strncmp(argv[i], "--limits=", 9) == 0)
+        {
+            if (load_limit_profiles(argv[i] + 9) == -1)
+                exit(1);
+        }
+        else if (strncmp(argv[i], "--binlog=", 9) == 0)
+        {
+            if (binlog_open(argv[i] + 9) == -1)
+                exit(1);
+        }
+        else if (strncmp(argv[i], "--log-fields=", 13) == 0)
+        {
+            char fields[MAX_SIZE];
+            snprintf(fields, sizeof(fields), "%s", argv[i] + 13);
+            for (char* field = strtok(fields, ","); field != NULL; field = strtok(NULL, ","))
+            {
+                if (strcmp(field, "pid") == 0)
+                    log_field_pid = 1;
+                else if (strcmp(field, "seq") == 0)
+                    log_field_seq = 1;
+                else
+                {
+                    fprintf(stderr, "Error: --log-fields takes pid and/or seq\n");
+                    exit(1);
+                }
+            }
+        }
+        else if (strncmp(argv[i], "--log-interval=", 15) == 0)
+        {
+            char* end;
+            long ms = strtol(argv[i] + 15, &end, 10);
+            if (end == argv[i] + 15 || *end != '\0' || ms < 1 || ms > 60000)
+            {
+                fprintf(stderr, "Error: --log-interval takes milliseconds between 1 and 60000\n");
+                exit(1);
+            }
+            log_interval_ms = ms;
+        }
+        else if (strcmp(argv[i], "--resume-stats") == 0)
+            resume_stats_flag = 1;
+        else if (strcmp(argv[i], "--no-shm") == 0)
+            shm_enabled = 0;
+        else if (strcmp(argv[i], "--perf-counters") == 0)
+            perf_probe();
+        else if (strncmp(argv[i], "--trace=", 8) == 0)
+            trace_open(argv[i] + 8);
+        else if (strncmp(argv[i], "--rotate-size=", 14) == 0)
+        {
+            rlim_t value;
+            if (size_value(argv[i] + 14, &value) == -1 || value == 0 || value == RLIM_INFINITY)
+            {
+                fprintf(stderr, "Error: --rotate-size takes a size like 100M\n");
+                exit(1);
+            }
+            rotate_size = value;
+        }
+        else if (strncmp(argv[i], "--rotate-age=", 13) == 0)
+        {
+            char* end;
+            long age = strtol(argv[i] + 13, &end, 10);
+            long unit = strcmp(end, "d") == 0 ? 86400 : strcmp(end, "h") == 0 ? 3600 : strcmp(end, "m") == 0 ? 60 :
+                        (strcmp(end, "s") == 0 || *end == '\0') ? 1 : 0;
+            if (end == argv[i] + 13 || age < 1 || unit == 0)
+            {
+                fprintf(stderr, "Error: --rotate-age takes a duration like 3600, 90m, 12h or 7d\n");
+                exit(1);
+            }
+            rotate_age = age * unit;
+        }
+        else if (strncmp(argv[i], "--rotate-keep=", 14) == 0)
+        {
+            char* end;
+            long keep = strtol(argv[i] + 14, &end, 10);
+            if (end == argv[i] + 14 || *end != '\0' || keep < 1 || keep > 10000)
+            {
+                fprintf(stderr, "Error: --rotate-keep takes a number of segments between 1 and 10000\n");
+                exit(1);
+            }
+            rotate_keep = keep;
+        }
+        else if (strncmp(argv[i], "--stats-window=", 15) == 0)
+        {
+            if (set_stats_window(argv[i] + 15) == -1)
+            {
+                fprintf(stderr, "Error: --stats-window takes a number of commands (1-%d) or seconds like 60s\n", STATS_WINDOW_MAX);
+                exit(1);
+            }
+        }
+        else
+        {
+            fprintf(stderr, "Error: unknown option %s\n", argv[i]);
+            exit(1);
+        }
+    }
+}
+
 FILE* open_file(char* filename, char* mode)
 {
     FILE* file = fopen(filename, mode);
@@ -457,6 +1118,22 @@ double execute_command(char* command[], char* original_input)
         }
     }
 
+    // the redirection words are taken out of the arguments here, the files are opened in the child
+    struct redirections redirect;
+    if (parse_redirections(command, last_arg, &redirect) == -1)
+    {
+        printf("ERR\n");
+        return -1;
+    }
+
+    fflush(stdout); // a child that fails before exec would flush a copy of the pending output
+
+    int perf_gate[2] = { -1, -1 };
+    int perf_fds[PERF_EVENTS];
+    last_command_counters[0] = '\0';
+    if (perf_enabled && perf_gate_open(perf_gate) == -1)
+        perror("pipe");
+
     pid = fork();
     if (pid < 0)
     {
@@ -465,8 +1142,11 @@ double execute_command(char* command[], char* original_input)
     }
     else if (pid == 0)
     {
-        // Check and handle stderr redirection if present
-        if (!handle_stderr_redirection(command)) {
+        perf_gate_wait(perf_gate);
+        apply_sched_profile(background);
+        apply_limit_profile(command[0], NULL, 0);
+
+        if (apply_redirections(&redirect) == -1) {
             exit(1);
         }
 
@@ -478,27 +1158,48 @@ double execute_command(char* command[], char* original_input)
     {
         struct timeval start, end;
         gettimeofday(&start, NULL);
+        perf_attach(pid, perf_gate, perf_fds);
+        PROFILE_POINT(PROFILE_SPAWN);
 
         if (!background) {
             // For foreground processes, wait normally
             int status;
-            waitpid(pid, &status, 0);
+            wait4(pid, &status, 0, &last_command_usage);
+            PROFILE_POINT(PROFILE_RUN);
             gettimeofday(&end, NULL);
+            perf_read(perf_fds, last_command_counters, sizeof(last_command_counters));
             double runtime = (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1000000.0;
+            last_command_status = status;
 
-            if (check_process_status(status, pid, original_input, global_exec_times, runtime, 0)) {
+            int success = check_process_status(status, pid, original_input, global_exec_times, runtime, 0);
+            PROFILE_POINT(PROFILE_REAP);
+            if (trace_fd != -1)
+            {
+                char args[64];
+                snprintf(args, sizeof(args), "\"status\":%d", status);
+                trace_span("command", original_input, pid, timeval_us(&start), timeval_us(&end), args);
+            }
+            if (success) {
                 return runtime;
             }
+            update_failure_stats(original_input, runtime, status, &last_command_usage);
             return -1;
         } else {
             // For background processes, store start time and return immediately
+            last_command_status = 0;
+            memset(&last_command_usage, 0, sizeof(last_command_usage));
             if (bg_count < MAX_BG_PROCESSES) {
                 bg_processes[bg_count].pid = pid;
                 bg_processes[bg_count].start_time = start;
                 strncpy(bg_processes[bg_count].command, original_input, MAX_SIZE - 1);
                 bg_processes[bg_count].command[MAX_SIZE - 1] = '\0';
+                bg_processes[bg_count].last_cpu_ticks = 0;
+                timerclear(&bg_processes[bg_count].last_sample);
+                memcpy(bg_processes[bg_count].perf_fds, perf_fds, sizeof(perf_fds));
                 bg_count++;
             }
+            else
+                perf_close(perf_fds);
 
             return 0; // Return 0 to indicate background process started
         }
@@ -572,520 +1273,4470 @@ void split_string(char* input, char* result[], int* count, int max_arg) {
     result[*count] = NULL; // NULL terminate for execvp
 }
 
-double handle_pipe(char* input, char* original_input, int pipe_index)
+// Splits "a | b | c" at every separator (" | ", " , ") into stages,
+// returns the number of stages or -1 if there are more than max_stages
+int split_stages(char* input, const char* separator, char stages[][MAX_SIZE], int max_stages)
 {
-    char input_left[MAX_SIZE];
-    char input_right[MAX_SIZE];
-    struct timeval start, end;
-    double runtime = 0;
+    int count = 0;
+    char* start = input;
 
-    strncpy(input_left, input, pipe_index-1);//splitting to left
-    input_left[pipe_index-1] = '\0';
+    while (1)
+    {
+        if (count >= max_stages)
+            return -1;
 
-    int right_start = pipe_index + 2; // +2 to skip the the first space
-    strcpy(input_right, &input[right_start]); //splitting to right
+        char* found = strstr(start, separator);
+        int len = found ? (int)(found - start) : (int)strlen(start);
 
-    char* left_command[MAX_ARG + 1];
-    char* right_command[MAX_ARG + 1];
+        memcpy(stages[count], start, len);
+        stages[count][len] = '\0';
+        count++;
 
-    // Initialize command arrays to NULL
-    for (int i = 0; i <= MAX_ARG; i++) {
-        left_command[i] = NULL;
-        right_command[i] = NULL;
+        if (found == NULL)
+            break;
+        start = found + strlen(separator);
     }
 
-    int left_arg_count = split_and_validate(input_left, original_input, left_command, 0);
-    int right_arg_count = split_and_validate(input_right, original_input, right_command, 0);
+    return count;
+}
 
-    if (left_arg_count == -1 || right_arg_count == -1)
-    {
-        free_resources(left_command, left_arg_count, NULL, 0);
-        free_resources(right_command, right_arg_count, NULL, 0);
-        return -1;
+// Splits and checks every stage and takes out its redirections before anything runs.
+// Returns -1 (with everything freed) if a stage is empty, malformed or dangerous.
+int prepare_stages(char stage_input[][MAX_SIZE], int count, char* original_input, char* stage_command[][MAX_ARG + 1], int stage_arg_count[], struct redirections stage_redirect[])
+{
+    // Initialize command arrays to NULL
+    for (int i = 0; i < count; i++) {
+        for (int j = 0; j <= MAX_ARG; j++) {
+            stage_command[i][j] = NULL;
+        }
+        stage_arg_count[i] = 0;
     }
 
-    if (left_arg_count == 0 || right_arg_count == 0)
+    for (int i = 0; i < count; i++)
     {
-        free_resources(left_command, left_arg_count, NULL, 0);
-        free_resources(right_command, right_arg_count, NULL, 0);
-        return -1;
-    }
+        stage_arg_count[i] = split_and_validate(stage_input[i], original_input, stage_command[i], 0);
 
-    // Check if either command is dangerous
-    int danger_status_left = check_dangerous_command(input_left, left_command, left_arg_count);
+        if (stage_arg_count[i] <= 0 || check_dangerous_command(stage_input[i], stage_command[i], stage_arg_count[i]) == 1)
+        {
+            free_stages(stage_command, stage_arg_count, count);
+            return -1;
+        }
 
-    if (danger_status_left == 1) // Dangerous left command detected
-    {
-        free_resources(left_command, left_arg_count, NULL, 0);
-        free_resources(right_command, right_arg_count, NULL, 0);
-        return -1;
+        int arg_count = parse_redirections(stage_command[i], stage_arg_count[i], &stage_redirect[i]);
+        if (arg_count == -1)
+        {
+            printf("ERR\n");
+            free_stages(stage_command, stage_arg_count, count);
+            return -1;
+        }
+        stage_arg_count[i] = arg_count;
     }
 
-    int danger_status_right = check_dangerous_command(input_right, right_command, right_arg_count);
+    return 0;
+}
 
-    if (danger_status_right == 1) // Dangerous right command detected
-    {
-        free_resources(left_command, left_arg_count, NULL, 0);
-        free_resources(right_command, right_arg_count, NULL, 0);
-        return -1;
-    }
+void free_stages(char* stage_command[][MAX_ARG + 1], int stage_arg_count[], int count)
+{
+    for (int i = 0; i < count; i++)
+        free_resources(stage_command[i], stage_arg_count[i], NULL, 0);
+}
 
-    int pipe_fd[2];
-    if (pipe(pipe_fd) == -1)
-    {
-        perror("pipe");
-        free_resources(left_command, left_arg_count, NULL, 0);
-        free_resources(right_command, right_arg_count, NULL, 0);
+// Runs in a stage's child once stdin/stdout are wired up to the pipes. The stage's own redirections
+// are applied on top of them, then my_tee runs here (fan-out consumers; pipelines run it as a
+// thread of the shell) and anything else is exec'd.
+void exec_stage(char* command[], int arg_count, const struct redirections* redirect)
+{
+    apply_sched_profile(0);
+    apply_limit_profile(command[0], NULL, 0);
+
+    if (apply_redirections(redirect) == -1) {
         exit(1);
     }
 
-    // Start timing for the entire pipe operation
-    gettimeofday(&start, NULL);
+    if (is_builtin_stage(command[0]))
+        exit(handle_mytee(command, arg_count));
 
-    pid_t pid_left = fork();
-    if (pid_left < 0)
-    {
-        perror("fork");
-        free_resources(left_command, left_arg_count, NULL, 0);
-        free_resources(right_command, right_arg_count, NULL, 0);
-        exit(1);
-    }
-    else if (pid_left == 0)
-    {
-        close(pipe_fd[0]); //closing the read end of the pipe
-        dup2(pipe_fd[1], STDOUT_FILENO); //redirecting stdout to the write end of the pipe
-        close(pipe_fd[1]); //closing the write end of the pipe now that he was redirected
+    execvp(command[0], command);
+    perror("execvp");//if we reached here there was an error
+    exit(1);
+}
 
-        execvp(left_command[0], left_command);
-        perror("execvp");//if we reached here there was an error
-        exit(1);
-    }
-    else
+// Checks every reaped stage and logs it as its own exec_times record; successful stages feed the
+// statistics. blocked (may be NULL, negative entries are skipped) is the time the shell waited on
+// the stage's input pipe. The first writers stages write into a pipe: one killed by SIGPIPE only
+// had its reader finish first (yes | head -1), it counts as a clean finish like in other shells.
+// notes (may be NULL, as may its entries) go at the end of the detail. Returns 1 if every stage succeeded.
+int record_stages(char stage_input[][MAX_SIZE], int count, pid_t stage_pid[], int status[], struct rusage usage[], struct timeval stage_start[], struct timeval stage_end[], const double blocked[], int writers, const char* notes[])
+{
+    int success = 1;
+
+    for (int i = 0; i < count; i++)
     {
-        pid_t pid_right = fork();
-        if (pid_right < 0)
+        char detail[MAX_SIZE];
+        double stage_runtime = (stage_end[i].tv_sec - stage_start[i].tv_sec) + (stage_end[i].tv_usec - stage_start[i].tv_usec) / 1000000.0;
+
+        describe_stage(i, count, status[i], &usage[i], detail, sizeof(detail));
+        if (stage_pid[i] == 0)
         {
-            perror("fork");
-            free_resources(left_command, left_arg_count, NULL, 0);
-            free_resources(right_command, right_arg_count, NULL, 0);
-            exit(1);
+            int len = strlen(detail);
+            snprintf(detail + len, sizeof(detail) - len, ", in-shell");
         }
-        else if (pid_right == 0)
+        if (blocked != NULL && blocked[i] >= 0)
         {
-            close(pipe_fd[1]); //closing the write end of the pipe
-            dup2(pipe_fd[0], STDIN_FILENO); //redirecting stdin to the read end of the pipe
-            close(pipe_fd[0]); //closing the read end of the pipe now that he was redirected
-
-            if (strcmp(right_command[0], "my_tee") == 0 || strcmp(right_command[0], "tee_my") == 0)
-            {
-                if (right_arg_count < 2)
-                {
-                    fprintf(stderr, "ERR: my_tee requires at least one output file\n");
-                    exit(1);
-                }
-                handle_mytee(right_command, right_arg_count);
-                exit(0);
-            }
+            int len = strlen(detail);
+            snprintf(detail + len, sizeof(detail) - len, ", blocked %.5f sec", blocked[i]);
+        }
+        if (notes != NULL && notes[i] != NULL && notes[i][0] != '\0')
+        {
+            int len = strlen(detail);
+            snprintf(detail + len, sizeof(detail) - len, ", %s", notes[i]);
+        }
 
-            if (!handle_stderr_redirection(right_command)) {
-                exit(1);
-            }
+        // builtin stages ran as threads of the shell, their binlog records have no child rusage
+        const struct rusage* stage_usage = stage_pid[i] == 0 ? NULL : &usage[i];
 
-            execvp(right_command[0], right_command);
-            perror("execvp");
-            exit(1);
+        if (i < writers && WIFSIGNALED(status[i]) && WTERMSIG(status[i]) == SIGPIPE)
+        {
+            int len = strlen(detail);
+            snprintf(detail + len, sizeof(detail) - len, ", reader finished first");
+            update_timing_stats_result(stage_runtime, stage_input[i], detail, 0, stage_usage);
+        }
+        else if (check_process_status(status[i], stage_pid[i], stage_input[i], global_exec_times, stage_runtime, 0))
+        {
+            update_timing_stats_result(stage_runtime, stage_input[i], detail, status[i], stage_usage);
         }
         else
         {
-            close(pipe_fd[0]);//the parent process also needs to close the read end of the pipe
-            close(pipe_fd[1]);
-
-            //waiting for the child processes to finish
-            int status1, status2;
-            waitpid(pid_left, &status1, 0);
-            waitpid(pid_right, &status2, 0);
-
-            gettimeofday(&end, NULL);
-            runtime = (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1000000.0;
-
-            // Check status of right command
-            int right_success = check_process_status(status2, pid_right, input_right, global_exec_times, runtime, 0);
-
-            free_resources(left_command, left_arg_count, NULL, 0);
-            free_resources(right_command, right_arg_count, NULL, 0);
-
-            // Return the runtime if both commands succeeded
-            if (right_success) {
-                return runtime;
-            }
-            return -1;  // Command failed
+            success = 0;
+            log_record("%s : failed %.5f sec (%s)\n", stage_input[i], stage_runtime, detail);
+            update_failure_stats(stage_input[i], stage_runtime, status[i], stage_usage);
         }
     }
-    return -1;
-}
 
+    return success;
+}
 
-void handle_mytee(char * command[], int right_arg_count)
+// Runs every stage of "a | b | ..." at the same time, with one pipe between each pair of neighbours.
+// Each stage is timed from its fork to its own exit and logged as a record of its own,
+// followed by one record for the whole pipeline.
+// Returns the runtime of the whole pipeline if every stage succeeded, -1 otherwise.
+double handle_pipe(char* input, char* original_input)
 {
-    int append_mode = 0;
-    int start_index = 1;
+    char stage_input[MAX_STAGES][MAX_SIZE];
+    char* stage_command[MAX_STAGES][MAX_ARG + 1];
+    int stage_arg_count[MAX_STAGES];
+    struct redirections stage_redirect[MAX_STAGES];
+    pid_t stage_pid[MAX_STAGES];
+    struct timeval stage_start[MAX_STAGES];
+    struct timeval stage_end[MAX_STAGES];
+    struct rusage stage_usage[MAX_STAGES];
+    int status[MAX_STAGES];
+    int builtin[MAX_STAGES];
+    struct builtin_stage builtin_stages[MAX_STAGES];
+    pthread_t threads[MAX_STAGES];
+    const char* notes[MAX_STAGES] = { NULL };
+    struct stage_channel channels[MAX_STAGES - 1];
+    struct buffer_pool pool;
+    int thread_count = 0;
+    struct timeval start, end;
+    double runtime = 0;
 
-    // Check for the -a option
-    if (strcmp(command[1], "-a") == 0) 
+    int count = split_stages(input, " | ", stage_input, MAX_STAGES);
+    if (count == -1)
     {
-        append_mode = 1;
-        start_index = 2;
+        printf("ERR_ARGS\n");
+        return -1;
     }
 
-    // Buffer to read from stdin
-    char buffer[MAX_SIZE];
+    // Parse and check every stage before anything runs
+    if (prepare_stages(stage_input, count, original_input, stage_command, stage_arg_count, stage_redirect) == -1)
+        return -1;
 
-    // Read from stdin
-    while (fgets(buffer, sizeof(buffer), stdin) != NULL)
+    // builtin stages (my_tee) run as threads of the shell instead of forked children
+    for (int i = 0; i < count; i++)
     {
-        // Write to stdout
-        printf("%s", buffer);
+        builtin[i] = is_builtin_stage(stage_command[i][0]);
+        thread_count += builtin[i];
+    }
 
-        // Write to each file
-        for (int i = start_index; i < right_arg_count; i++) {
-            FILE *file = open_file(command[i], append_mode ? "a" : "w");
-            if (file) {
-                fputs(buffer, file);
-                fclose(file);
-            } else {
-                fprintf(stderr, "Error opening file: %s\n", command[i]);
-            }
+    // link i joins stage i to stage i + 1: a channel between two builtins, a pipe otherwise
+    int pipe_fds[MAX_STAGES - 1][2];
+    for (int i = 0; i < count - 1; i++)
+    {
+        pipe_fds[i][0] = pipe_fds[i][1] = -1;
+        if (builtin[i] && builtin[i + 1])
+            continue;
+        if (create_pipe(pipe_fds[i]) == -1)
+        {
+            perror("pipe");
+            free_stages(stage_command, stage_arg_count, count);
+            exit(1);
         }
     }
-}
 
-int set_rlimit(int resource_code, int soft_limit, int hard_limit)
-{
-    struct rlimit rl;
-    rl.rlim_cur = soft_limit;
-    rl.rlim_max = hard_limit;
+    // handle_sigchild reaps with waitpid(-1), keep it away from our stages until we waited for them all
+    sigset_t block, old;
+    sigemptyset(&block);
+    sigaddset(&block, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &block, &old);
 
-    //return 0 if successful, -1 if not
-    return setrlimit(resource_code, &rl);
+    fflush(stdout); // otherwise every stage inherits and re-prints the pending prompt
+
+    // Start timing for the entire pipe operation
+    gettimeofday(&start, NULL);
+
+    for (int i = 0; i < count; i++)
+    {
+        gettimeofday(&stage_start[i], NULL);
+        stage_pid[i] = 0;
+        if (builtin[i])
+            continue;
+
+        stage_pid[i] = fork();
+        if (stage_pid[i] < 0)
+        {
+            perror("fork");
+            free_stages(stage_command, stage_arg_count, count);
+            exit(1);
+        }
+        else if (stage_pid[i] == 0)
+        {
+            sigprocmask(SIG_SETMASK, &old, NULL);
+
+            if (i > 0)
+                dup2(pipe_fds[i - 1][0], STDIN_FILENO); //reading from the previous stage
+            if (i < count - 1)
+                dup2(pipe_fds[i][1], STDOUT_FILENO); //writing to the next stage
+
+            //closing every pipe end now that the ones we need were redirected
+            for (int j = 0; j < count - 1; j++)
+            {
+                if (pipe_fds[j][0] == -1)
+                    continue;
+                close(pipe_fds[j][0]);
+                close(pipe_fds[j][1]);
+            }
+
+            exec_stage(stage_command[i], stage_arg_count[i], &stage_redirect[i]);
+        }
+    }
+
+    //the parent process closes every pipe end except the ones its builtin stages use
+    for (int i = 0; i < count - 1; i++)
+    {
+        if (pipe_fds[i][0] == -1)
+            continue;
+        if (!builtin[i + 1])
+            close(pipe_fds[i][0]);
+        if (!builtin[i])
+            close(pipe_fds[i][1]);
+    }
+
+    void (*old_sigpipe)(int) = SIG_DFL;
+    if (thread_count > 0)
+    {
+        // a stage that exits early must not take the shell down with SIGPIPE, the children were
+        // forked with the default action so they still get it
+        old_sigpipe = signal(SIGPIPE, SIG_IGN);
+
+        pthread_mutex_init(&pool.lock, NULL);
+        pthread_cond_init(&pool.changed, NULL);
+        pool.free_count = 0;
+
+        for (int i = 0; i < count; i++)
+        {
+            if (!builtin[i])
+                continue;
+
+            struct builtin_stage* stage = &builtin_stages[i];
+            memset(stage, 0, sizeof(*stage));
+            stage->command = stage_command[i];
+            stage->arg_count = stage_arg_count[i];
+            stage->redirect = &stage_redirect[i];
+            stage->err_fd = STDERR_FILENO;
+            stage->in_shell = 1;
+
+            if (i == 0)
+                stage->in_fd = STDIN_FILENO;
+            else if (builtin[i - 1])
+            {
+                stage->in_fd = -1;
+                stage->in_channel = &channels[i - 1];
+            }
+            else
+            {
+                stage->in_fd = pipe_fds[i - 1][0];
+                stage->close_in = 1;
+            }
+
+            if (i == count - 1)
+                stage->out_fd = STDOUT_FILENO;
+            else if (builtin[i + 1])
+            {
+                stage->out_fd = -1;
+                stage->out_channel = &channels[i];
+                memset(&channels[i], 0, sizeof(channels[i]));
+                channels[i].pool = &pool;
+            }
+            else
+            {
+                stage->out_fd = pipe_fds[i][1];
+                stage->close_out = 1;
+            }
+        }
+
+        for (int i = 0; i < count; i++)
+        {
+            if (builtin[i] && pthread_create(&threads[i], NULL, run_builtin_stage, &builtin_stages[i]) != 0)
+            {
+                perror("pthread_create");
+                exit(1);
+            }
+        }
+    }
+
+    //waiting for the child processes to finish, each one is reaped as soon as it exits
+    wait_pipeline_stages(stage_pid, count, status, stage_usage, stage_end);
+
+    if (thread_count > 0)
+    {
+        for (int i = 0; i < count; i++)
+        {
+            if (!builtin[i])
+                continue;
+            pthread_join(threads[i], NULL);
+            status[i] = builtin_stages[i].status;
+            stage_usage[i] = builtin_stages[i].usage;
+            stage_end[i] = builtin_stages[i].end;
+            notes[i] = builtin_stages[i].note;
+        }
+
+        pool_destroy(&pool);
+        signal(SIGPIPE, old_sigpipe);
+    }
+
+    gettimeofday(&end, NULL);
+    sigprocmask(SIG_SETMASK, &old, NULL);
+    runtime = (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1000000.0;
+
+    // Check and record the status of every stage
+    int success = record_stages(stage_input, count, stage_pid, status, stage_usage, stage_start, stage_end, NULL, count - 1, notes);
+    if (trace_fd != -1)
+    {
+        pid_t lane[MAX_STAGES];
+        for (int i = 0; i < count; i++)
+            lane[i] = builtin[i] ? builtin_stages[i].tid : stage_pid[i];
+        trace_stages(stage_input, count, lane, stage_start, stage_end);
+        trace_span("pipeline", original_input, getpid(), timeval_us(&start), timeval_us(&end), NULL);
+    }
+
+    // the whole pipeline is logged for reference only, its stages were already counted
+    log_record("%s : %.5f sec (pipeline, %d stages)\n", original_input, runtime, count);
+
+    free_stages(stage_command, stage_arg_count, count);
+
+    // Return the runtime if all commands succeeded
+    if (success) {
+        return runtime;
+    }
+    return -1;  // Command failed
 }
 
-int size_value(const char* value_str)
+// "producer |> consumer , consumer , ..." runs one producer and feeds a copy of its output to
+// every consumer. The shell itself duplicates the stream with the my_tee fan-out (zero-copy
+// when possible), so no temp files or extra processes are needed. Consumers advance in
+// lockstep: the time the shell waited on each one's input pipe is reported as its backpressure.
+// Returns the runtime of the whole fan-out if every process succeeded, -1 otherwise.
+double handle_fanout(char* input, char* original_input)
 {
-    int value = atoi(value_str);
-    int len = strlen(value_str);
-    
-    // Find where the numeric part ends
-    int i;
-    for (i = 0; i < len; i++) {
-        if (!isdigit(value_str[i])) {
-            break;
+    char stage_input[MAX_STAGES][MAX_SIZE];
+    char* stage_command[MAX_STAGES][MAX_ARG + 1];
+    int stage_arg_count[MAX_STAGES];
+    struct redirections stage_redirect[MAX_STAGES];
+    pid_t stage_pid[MAX_STAGES];
+    struct timeval stage_start[MAX_STAGES];
+    struct timeval stage_end[MAX_STAGES];
+    struct rusage stage_usage[MAX_STAGES];
+    int status[MAX_STAGES];
+    double blocked[MAX_STAGES];
+    struct timeval start, end;
+
+    // stage 0 is the producer, the rest are consumers
+    char* separator = strstr(input, " |> ");
+    int producer_len = separator - input;
+    strncpy(stage_input[0], input, producer_len);
+    stage_input[0][producer_len] = '\0';
+
+    int consumers = split_stages(separator + 4, " , ", stage_input + 1, MAX_STAGES - 1);
+    if (consumers == -1 || strstr(separator + 4, " |> ") != NULL)
+    {
+        printf("ERR_ARGS\n");
+        return -1;
+    }
+    int count = consumers + 1;
+
+    if (prepare_stages(stage_input, count, original_input, stage_command, stage_arg_count, stage_redirect) == -1)
+        return -1;
+
+    // pipe_fds[0] carries the producer's output to the shell, pipe_fds[i] feeds consumer i
+    int pipe_fds[MAX_STAGES][2];
+    for (int i = 0; i < count; i++)
+    {
+        if (create_pipe(pipe_fds[i]) == -1)
+        {
+            perror("pipe");
+            free_stages(stage_command, stage_arg_count, count);
+            exit(1);
         }
     }
-    
-    // If the entire string is numeric, return the value as is
-    if (i == len) {
-        return value;
+
+    sigset_t block, old;
+    sigemptyset(&block);
+    sigaddset(&block, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &block, &old);
+
+    fflush(stdout);
+    gettimeofday(&start, NULL);
+
+    for (int i = 0; i < count; i++)
+    {
+        gettimeofday(&stage_start[i], NULL);
+        stage_pid[i] = fork();
+        if (stage_pid[i] < 0)
+        {
+            perror("fork");
+            free_stages(stage_command, stage_arg_count, count);
+            exit(1);
+        }
+        else if (stage_pid[i] == 0)
+        {
+            sigprocmask(SIG_SETMASK, &old, NULL);
+
+            if (i == 0)
+                dup2(pipe_fds[0][1], STDOUT_FILENO); //the producer writes to the shell
+            else
+                dup2(pipe_fds[i][0], STDIN_FILENO); //a consumer reads its own copy
+
+            for (int j = 0; j < count; j++)
+            {
+                close(pipe_fds[j][0]);
+                close(pipe_fds[j][1]);
+            }
+
+            exec_stage(stage_command[i], stage_arg_count[i], &stage_redirect[i]);
+        }
     }
-    
-    // Get the unit part
-    const char* unit = &value_str[i];
-    
-    // Convert based on unit
-    if (strcmp(unit, "B") == 0) {
-        return value; // Bytes
-    } else if (strcmp(unit, "K") == 0 || strcmp(unit, "KB") == 0) {
-        return value * BYTES_IN_KB; // Kilobytes
-    } else if (strcmp(unit, "M") == 0 || strcmp(unit, "MB") == 0) {
-        return value * BYTES_IN_MB; // Megabytes
-    } else if (strcmp(unit, "G") == 0 || strcmp(unit, "GB") == 0) {
-        return value * BYTES_IN_GB; // Gigabytes
+
+    // keep only the producer's read end and the consumers' write ends
+    int out_fds[MAX_STAGES];
+    close(pipe_fds[0][1]);
+    for (int i = 1; i < count; i++)
+    {
+        close(pipe_fds[i][0]);
+        out_fds[i - 1] = pipe_fds[i][1];
     }
-    
-    // If no valid unit, return the value as is
-    return value;
+
+    // a consumer that exits early (head) must not take the shell down with SIGPIPE
+    void (*old_sigpipe)(int) = signal(SIGPIPE, SIG_IGN);
+
+    unsigned long long total_bytes = 0;
+    blocked[0] = -1; // nothing waits on the producer's side
+    for (int i = 1; i < count; i++)
+        blocked[i] = 0;
+
+    if (tee_fanout_zero_copy(pipe_fds[0][0], out_fds, consumers, &total_bytes, blocked + 1) == -1)
+        tee_fanout(pipe_fds[0][0], out_fds, consumers, &total_bytes, blocked + 1);
+
+    close(pipe_fds[0][0]);
+    for (int i = 0; i < consumers; i++)
+        close(out_fds[i]);
+    signal(SIGPIPE, old_sigpipe);
+
+    wait_pipeline_stages(stage_pid, count, status, stage_usage, stage_end);
+
+    gettimeofday(&end, NULL);
+    sigprocmask(SIG_SETMASK, &old, NULL);
+    double runtime = (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1000000.0;
+
+    fprintf(stderr, "fan-out: %llu bytes to %d consumers in %.5f sec (%.2f MB/s)\n", total_bytes, consumers, runtime,
+            runtime > 0 ? total_bytes / (double)BYTES_IN_MB / runtime : 0.0);
+    for (int i = 1; i < count; i++)
+    {
+        double stage_runtime = (stage_end[i].tv_sec - stage_start[i].tv_sec) + (stage_end[i].tv_usec - stage_start[i].tv_usec) / 1000000.0;
+        fprintf(stderr, "  [%d] %s: %.5f sec, blocked %.5f sec\n", i, stage_input[i], stage_runtime, blocked[i]);
+    }
+
+    int success = record_stages(stage_input, count, stage_pid, status, stage_usage, stage_start, stage_end, blocked, 1, NULL); // only the producer writes into a pipe
+    if (trace_fd != -1)
+    {
+        trace_stages(stage_input, count, stage_pid, stage_start, stage_end);
+        trace_span("fan-out", original_input, getpid(), timeval_us(&start), timeval_us(&end), NULL); // the shell tees meanwhile
+    }
+
+    log_record("%s : %.5f sec (fan-out, %d consumers)\n", original_input, runtime, consumers);
+
+    free_stages(stage_command, stage_arg_count, count);
+
+    if (success) {
+        return runtime;
+    }
+    return -1;
 }
 
+// pipe(2) with the capacity chosen by pipesize=, a capacity the kernel refuses only gets a warning
+int create_pipe(int fds[2])
+{
+    if (pipe(fds) == -1)
+        return -1;
 
-int handle_rlimit(char* command[], int arg_count, FILE* exec_times, int* cmd, double* total_time, double* last_cmd_time, double* avg_time, double* min_time, double* max_time)
+    if (pipe_size > 0 && fcntl(fds[1], F_SETPIPE_SZ, (int)pipe_size) == -1)
+        perror("F_SETPIPE_SZ");
+
+    return 0;
+}
+
+// pipesize=<size>|default : capacity of the pipes created for pipelines and fan-outs
+int handle_pipesize(const char* arg)
 {
-    if (arg_count < 2)
+    if (strcmp(arg, "default") == 0)
+    {
+        pipe_size = 0;
         return 0;
+    }
 
-    int resource_code; //0 for cpu, 1 for memory, 2 for size, 3 for files
+    rlim_t value;
+    if (size_value(arg, &value) == -1 || value == 0 || value > INT_MAX)
+    {
+        printf("ERR\n");
+        return -1;
+    }
 
-    if (strcmp(command[1], "show") == 0)
+    pipe_size = (long)value;
+    return 0;
+}
+
+// Reaps every stage of a pipeline in the order they exit, collecting exit status, rusage and the exit time.
+// SIGCHLD must be blocked by the caller. With pidfds we poll all stages at once; on kernels without
+// pidfd_open we fall back to waiting in order, which makes an early stage's end time the reap time.
+int wait_pipeline_stages(pid_t stage_pid[], int count, int status[], struct rusage usage[], struct timeval end[])
+{
+    struct pollfd fds[MAX_STAGES];
+    int remaining = count;
+
+    for (int i = 0; i < count; i++)
     {
-        // Check for exact argument count - should be exactly 2 ("rlimit" and "show")
-        if (arg_count != 2) 
+        if (stage_pid[i] == 0) // a builtin stage, joined by handle_pipe
         {
-            return 0;
+            fds[i].fd = -2;
+            remaining--;
+            continue;
         }
+#ifdef SYS_pidfd_open
+        fds[i].fd = (int)syscall(SYS_pidfd_open, stage_pid[i], 0);
+#else
+        fds[i].fd = -1;
+#endif
+        fds[i].events = POLLIN; // a stage without a pidfd (-1) is waited for after the others
+    }
 
-        struct timeval start, end;
-        gettimeofday(&start, NULL);
+    while (remaining > 0)
+    {
+        int polled = 0;
+        for (int i = 0; i < count; i++)
+            polled |= fds[i].fd >= 0;
 
-        struct rlimit cpu_rl, mem_rl,fsize_rl,files_rl;
-        
-        // Get CPU limits
-        getrlimit(RLIMIT_CPU, &cpu_rl);
-        
-        // Get memory limits
-        getrlimit(RLIMIT_AS, &mem_rl);
+        if (!polled)
+            break;
 
-        // Get size limits
-        getrlimit(RLIMIT_FSIZE, &fsize_rl);
-        
-        // Get open files limits
-        getrlimit(RLIMIT_NOFILE, &files_rl);
+        if (poll(fds, count, -1) == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
 
-        // Print the limits
-        
-        if (cpu_rl.rlim_cur == RLIM_INFINITY) //cpu limit
-            printf("CPU time: soft=unlimited, hard=unlimited\n");
-        else
-            printf("CPU time: soft=%lus, hard=%lus\n", (unsigned long)cpu_rl.rlim_cur, (unsigned long)cpu_rl.rlim_max);
+        for (int i = 0; i < count; i++)
+        {
+            if (fds[i].fd < 0 || !(fds[i].revents & (POLLIN | POLLHUP)))
+                continue;
+
+            wait4(stage_pid[i], &status[i], 0, &usage[i]);
+            gettimeofday(&end[i], NULL);
+            close(fds[i].fd);
+            fds[i].fd = -2; // reaped, poll ignores negative fds
+            remaining--;
+        }
+    }
 
-        if (mem_rl.rlim_cur == RLIM_INFINITY) //memory limit
-            printf("Memory: soft=unlimited, hard=unlimited\n");
-        else
-            printf("Memory: soft=%lu, hard=%lu\n", (unsigned long)mem_rl.rlim_cur, (unsigned long)mem_rl.rlim_max);
+    for (int i = 0; i < count; i++)
+    {
+        if (fds[i].fd == -2)
+            continue;
+        if (fds[i].fd >= 0)
+            close(fds[i].fd);
 
-        if (fsize_rl.rlim_cur == RLIM_INFINITY) //fsize limit
-            printf("File size: soft=unlimited, hard=unlimited\n");
-        else
-            printf("File size: soft=%lu, hard=%lu\n", (unsigned long)fsize_rl.rlim_cur, (unsigned long)fsize_rl.rlim_max);
-            
-        if (files_rl.rlim_cur == RLIM_INFINITY) //open files limit
-            printf("Open files: soft=unlimited, hard=unlimited\n");
-        else
-            printf("Open files: soft=%lu, hard=%lu\n", (unsigned long)files_rl.rlim_cur, (unsigned long)files_rl.rlim_max);
+        wait4(stage_pid[i], &status[i], 0, &usage[i]);
+        gettimeofday(&end[i], NULL);
+    }
 
-        gettimeofday(&end, NULL);
-        double runtime = (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1000000.0;
+    return 0;
+}
 
-        // Update timing statistics using the new function
-        update_timing_stats(runtime, "rlimit show");
+// Builds the "(stage 2/3, exit 0, user ... sys ... maxrss ...)" part of a stage's exec_times record
+void describe_stage(int index, int count, int status, const struct rusage* usage, char* buffer, size_t size)
+{
+    char result[32];
+    if (WIFSIGNALED(status))
+        snprintf(result, sizeof(result), "signal %d", WTERMSIG(status));
+    else
+        snprintf(result, sizeof(result), "exit %d", WEXITSTATUS(status));
 
-        for (int i = 0; command[i] != NULL; i++) {
-        free(command[i]);
-        command[i] = NULL;
-    }
+    snprintf(buffer, size, "stage %d/%d, %s, user %.5f sec, sys %.5f sec, maxrss %ldK",
+             index + 1, count, result,
+             usage->ru_utime.tv_sec + usage->ru_utime.tv_usec / 1000000.0,
+             usage->ru_stime.tv_sec + usage->ru_stime.tv_usec / 1000000.0,
+             usage->ru_maxrss);
+}
+
+// my_tee [-a] file... : copies stdin to stdout and to every file, in a forked child.
+// Returns the exit code for the child.
+int handle_mytee(char * command[], int right_arg_count)
+{
+    struct builtin_stage stage;
+    memset(&stage, 0, sizeof(stage));
+    stage.command = command;
+    stage.arg_count = right_arg_count;
+    stage.in_fd = STDIN_FILENO;
+    stage.out_fd = STDOUT_FILENO;
+    stage.err_fd = STDERR_FILENO;
+
+    return run_mytee(&stage);
+}
+
+// Stages the shell runs itself. Only my_tee streams data, other builtins print to the terminal.
+int is_builtin_stage(const char* name)
+{
+    return strcmp(name, "my_tee") == 0 || strcmp(name, "tee_my") == 0;
+}
+
+// The body of my_tee for a forked child or a shell thread. Files are opened once and the data
+// moves in large binary-safe chunks: through the kernel when both sides are fds, otherwise
+// through the pipeline's buffers. Returns the exit code.
+int run_mytee(struct builtin_stage* stage)
+{
+    char** command = stage->command;
+    int append_mode = 0;
+    int start_index = 1;
 
+    if (stage->arg_count < 2)
+    {
+        dprintf(stage->err_fd, "ERR: my_tee requires at least one output file\n");
         return 1;
     }
-    
-    if (strcmp(command[1], "set") == 0)
+
+    // Check for the -a option
+    if (strcmp(command[1], "-a") == 0) 
     {
-        if (arg_count < 3)
+        append_mode = 1;
+        start_index = 2;
+    }
+
+    // the stage's own output comes first unless it goes to the next stage's channel
+    int out_fds[MAX_ARG + 1];
+    int out_count = 0;
+    if (stage->out_channel == NULL)
+        out_fds[out_count++] = stage->out_fd;
+    int first_file = out_count;
+
+    for (int i = start_index; i < stage->arg_count; i++)
+    {
+        int fd = open(command[i], O_WRONLY | O_CREAT | O_CLOEXEC | (append_mode ? O_APPEND : O_TRUNC), 0644);
+        if (fd == -1)
         {
-            printf("ERR\n");
-            return 0;
+            if (errno == EMFILE && !stage->in_shell)  // Too many open files, the shell itself must not exit
+                raise(SIGUSR1);
+            dprintf(stage->err_fd, "Error opening file: %s\n", command[i]);
+            continue;
         }
+        out_fds[out_count++] = fd;
+    }
 
-        // Find where the actual command starts after the resource limits
-        int cmd_start = 2;
-        for (; cmd_start < arg_count; cmd_start++) {
-            if (strchr(command[cmd_start], '=') == NULL) {
-                break;
-            }
+    struct timeval start, end;
+    unsigned long long total_bytes = 0;
+    int zero_copy = 0;
+    gettimeofday(&start, NULL);
+
+    if (stage->in_channel == NULL && stage->out_channel == NULL)
+    {
+        // when the input is a pipe the data can be duplicated inside the kernel, otherwise copy it through our buffer
+        zero_copy = tee_fanout_zero_copy(stage->in_fd, out_fds, out_count, &total_bytes, NULL) == 0;
+        if (!zero_copy)
+            tee_fanout(stage->in_fd, out_fds, out_count, &total_bytes, NULL);
+    }
+    else
+        tee_channel(stage, out_fds, out_count, &total_bytes);
+
+    gettimeofday(&end, NULL);
+    for (int i = first_file; i < out_count; i++)
+        close(out_fds[i]);
+
+    double runtime = (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1000000.0;
+    snprintf(stage->note, sizeof(stage->note), "%llu bytes, %.2f MB/s%s", total_bytes,
+             runtime > 0 ? total_bytes / (double)BYTES_IN_MB / runtime : 0.0,
+             zero_copy ? ", zero-copy" : (stage->in_channel || stage->out_channel) ? ", handoff" : "");
+    return 0;
+}
+
+// Thread body of a builtin pipeline stage. When it returns every pipe end and channel of the
+// stage is closed, so its neighbours see end of input / a gone reader just like with a process.
+void* run_builtin_stage(void* arg)
+{
+    struct builtin_stage* stage = arg;
+    stage->tid = gettid();
+    struct stage_channel* in_channel = stage->in_channel;
+    struct stage_channel* out_channel = stage->out_channel;
+    int in_fd = stage->in_fd;
+    int out_fd = stage->out_fd;
+    int opened[MAX_REDIRECTS];
+    int opened_count = 0;
+    int code = 1;
+
+    if (resolve_stage_redirections(stage, opened, &opened_count) == 0)
+        code = run_mytee(stage);
+
+    for (int i = 0; i < opened_count; i++)
+        close(opened[i]);
+    if (out_channel != NULL)
+        channel_close(out_channel);
+    if (in_channel != NULL)
+        channel_abandon(in_channel);
+    if (stage->close_in)
+        close(in_fd);
+    if (stage->close_out)
+        close(out_fd);
+
+    getrusage(RUSAGE_THREAD, &stage->usage);
+    gettimeofday(&stage->end, NULL);
+    stage->status = W_EXITCODE(code, 0);
+    return NULL;
+}
+
+// A thread can't dup2 over the shell's own descriptors, so a builtin stage's redirections only
+// swap which fds it uses for stdin, stdout and stderr. Files it opens go to opened for closing.
+// Returns -1 (with a message) for a redirection of another fd or a copy of a channel.
+int resolve_stage_redirections(struct builtin_stage* stage, int opened[], int* opened_count)
+{
+    int fds[3] = { stage->in_fd, stage->out_fd, stage->err_fd };
+
+    for (int i = 0; i < stage->redirect->count; i++)
+    {
+        const struct redirect* entry = &stage->redirect->entries[i];
+
+        if (entry->fd > STDERR_FILENO || (entry->type == REDIRECT_DUP && (entry->source_fd > STDERR_FILENO || fds[entry->source_fd] == -1)))
+        {
+            dprintf(stage->err_fd, "%s: only stdin, stdout and stderr can be redirected in a builtin stage\n", stage->command[0]);
+            return -1;
         }
 
-        // If no command after limits, return error
-        if (cmd_start >= arg_count) {
-            printf("ERR\n");  // No command provided after limits
-            return 0;
+        if (entry->type == REDIRECT_DUP)
+        {
+            fds[entry->fd] = fds[entry->source_fd];
+            continue;
         }
 
-        // If we have a command, fork and run it with the new limits
-        pid_t pid = fork();
-        if (pid < 0) {
-            perror("fork");
-            return 0;
+        int flags = O_RDONLY | O_CLOEXEC;
+        if (entry->type == REDIRECT_TRUNCATE)
+            flags = O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC;
+        else if (entry->type == REDIRECT_APPEND)
+            flags = O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC;
+
+        int fd = open(entry->path, flags, 0644);
+        if (fd == -1)
+        {
+            dprintf(stage->err_fd, "%s: %s\n", entry->path, strerror(errno));
+            return -1;
         }
-        else if (pid == 0) {
-            // Child process - set up signal handlers first
-            signal(SIGXCPU, handle_sigcpu);
+        opened[(*opened_count)++] = fd;
+        fds[entry->fd] = fd;
+    }
+
+    // a redirected stdin/stdout replaces the channel, which is still closed when the stage ends
+    if (fds[0] != stage->in_fd)
+        stage->in_channel = NULL;
+    if (fds[1] != stage->out_fd)
+        stage->out_channel = NULL;
+    stage->in_fd = fds[0];
+    stage->out_fd = fds[1];
+    stage->err_fd = fds[2];
+    return 0;
+}
+
+// Copy loop of a builtin stage next to another builtin. Buffers come from the previous stage's
+// channel or are read from in_fd into a pool buffer, are written to every fd in out_fds and are
+// then handed to the next stage's channel as they are.
+int tee_channel(struct builtin_stage* stage, int out_fds[], int out_count, unsigned long long* total_bytes)
+{
+    struct buffer_pool* pool = stage->in_channel != NULL ? stage->in_channel->pool : stage->out_channel->pool;
+    int active[MAX_ARG + 1];
+    for (int i = 0; i < out_count; i++)
+        active[i] = 1;
+
+    int result = 0;
+    while (1)
+    {
+        char* buffer;
+        ssize_t n;
+
+        if (stage->in_channel != NULL)
+        {
+            n = channel_receive(stage->in_channel, &buffer);
+            if (n == 0)
+                break;
+        }
+        else
+        {
+            buffer = pool_get(pool);
+            if (buffer == NULL)
+            {
+                result = -1;
+                break;
+            }
+            n = read(stage->in_fd, buffer, TEE_BUFFER_SIZE);
+            if (n <= 0)
+            {
+                pool_put(pool, buffer);
+                if (n == -1 && errno == EINTR)
+                    continue;
+                if (n == -1)
+                {
+                    dprintf(stage->err_fd, "my_tee: read: %s\n", strerror(errno));
+                    result = -1;
+                }
+                break;
+            }
+        }
+
+        for (int i = 0; i < out_count; i++)
+        {
+            if (active[i] && write_all(out_fds[i], buffer, n) == -1)
+                active[i] = 0;
+        }
+        *total_bytes += n;
+
+        if (stage->out_channel != NULL)
+            channel_send(stage->out_channel, buffer, n); // a gone reader just drops it
+        else
+            pool_put(pool, buffer);
+    }
+
+    return result;
+}
+
+char* pool_get(struct buffer_pool* pool)
+{
+    char* buffer = NULL;
+
+    pthread_mutex_lock(&pool->lock);
+    if (pool->free_count > 0)
+        buffer = pool->free_buffers[--pool->free_count];
+    pthread_mutex_unlock(&pool->lock);
+
+    if (buffer == NULL)
+    {
+        buffer = malloc(TEE_BUFFER_SIZE);
+        if (buffer == NULL)
+            perror("malloc");
+    }
+    return buffer;
+}
+
+// Returns a buffer to the pool, the caller must hold pool->lock
+void pool_put_locked(struct buffer_pool* pool, char* buffer)
+{
+    int capacity = sizeof(pool->free_buffers) / sizeof(pool->free_buffers[0]);
+    if (pool->free_count < capacity)
+        pool->free_buffers[pool->free_count++] = buffer;
+    else
+        free(buffer);
+}
+
+void pool_put(struct buffer_pool* pool, char* buffer)
+{
+    pthread_mutex_lock(&pool->lock);
+    pool_put_locked(pool, buffer);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+// Frees the pool once every stage was joined, all buffers are back in it by then
+void pool_destroy(struct buffer_pool* pool)
+{
+    for (int i = 0; i < pool->free_count; i++)
+        free(pool->free_buffers[i]);
+    pool->free_count = 0;
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->changed);
+}
+
+// Hands a filled buffer to the next stage, waiting while CHANNEL_DEPTH buffers are queued.
+// If the reader is gone the buffer goes back to the pool and -1 is returned.
+int channel_send(struct stage_channel* channel, char* buffer, size_t len)
+{
+    struct buffer_pool* pool = channel->pool;
+
+    pthread_mutex_lock(&pool->lock);
+    while (channel->count == CHANNEL_DEPTH && !channel->abandoned)
+        pthread_cond_wait(&pool->changed, &pool->lock);
+
+    if (channel->abandoned)
+    {
+        pool_put_locked(pool, buffer);
+        pthread_mutex_unlock(&pool->lock);
+        return -1;
+    }
+
+    int tail = (channel->head + channel->count) % CHANNEL_DEPTH;
+    channel->buffers[tail] = buffer;
+    channel->lengths[tail] = len;
+    channel->count++;
+    pthread_cond_broadcast(&pool->changed);
+    pthread_mutex_unlock(&pool->lock);
+    return 0;
+}
+
+// Takes the next buffer from the previous stage, the caller owns it afterwards.
+// Returns its length, or 0 once the writer closed the channel and it is empty.
+size_t channel_receive(struct stage_channel* channel, char** buffer)
+{
+    struct buffer_pool* pool = channel->pool;
+    size_t len = 0;
+
+    pthread_mutex_lock(&pool->lock);
+    while (channel->count == 0 && !channel->closed)
+        pthread_cond_wait(&pool->changed, &pool->lock);
+
+    if (channel->count > 0)
+    {
+        *buffer = channel->buffers[channel->head];
+        len = channel->lengths[channel->head];
+        channel->head = (channel->head + 1) % CHANNEL_DEPTH;
+        channel->count--;
+        pthread_cond_broadcast(&pool->changed);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return len;
+}
+
+void channel_close(struct stage_channel* channel)
+{
+    pthread_mutex_lock(&channel->pool->lock);
+    channel->closed = 1;
+    pthread_cond_broadcast(&channel->pool->changed);
+    pthread_mutex_unlock(&channel->pool->lock);
+}
+
+// The reader is done: drop whatever is queued and wake a writer waiting for room
+void channel_abandon(struct stage_channel* channel)
+{
+    pthread_mutex_lock(&channel->pool->lock);
+    channel->abandoned = 1;
+    while (channel->count > 0)
+    {
+        pool_put_locked(channel->pool, channel->buffers[channel->head]);
+        channel->head = (channel->head + 1) % CHANNEL_DEPTH;
+        channel->count--;
+    }
+    pthread_cond_broadcast(&channel->pool->changed);
+    pthread_mutex_unlock(&channel->pool->lock);
+}
+
+// Writes the whole buffer, retrying short writes. Returns -1 on error.
+int write_all(int fd, const char* buffer, size_t len)
+{
+    while (len > 0)
+    {
+        ssize_t written = write(fd, buffer, len);
+        if (written == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        buffer += written;
+        len -= written;
+    }
+    return 0;
+}
+
+// Moves exactly len bytes out of pipe_fd into out_fd with splice(2), or through buffer with
+// read/write where out_fd does not support splice (a terminal, an O_APPEND file on older kernels).
+// out_fd -1 just discards the bytes. Returns -1 if writing to out_fd failed, the bytes are consumed anyway.
+int drain_pipe_to(int pipe_fd, int out_fd, size_t len, char* buffer)
+{
+    int result = 0;
+
+    while (len > 0)
+    {
+        ssize_t n = -1;
+        if (out_fd >= 0 && result == 0)
+        {
+            n = splice(pipe_fd, NULL, out_fd, NULL, len, SPLICE_F_MOVE);
+            if (n == -1 && errno == EINTR)
+                continue;
+            if (n == 0)
+                return -1;
+            if (n == -1 && errno != EINVAL)
+                result = -1;
+        }
+
+        if (n == -1) // no splice for this fd (or it failed), copy or discard through the buffer
+        {
+            n = read(pipe_fd, buffer, len < TEE_BUFFER_SIZE ? len : TEE_BUFFER_SIZE);
+            if (n == -1 && errno == EINTR)
+                continue;
+            if (n <= 0)
+                return -1;
+            if (out_fd >= 0 && result == 0 && write_all(out_fd, buffer, n) == -1)
+                result = -1;
+        }
+
+        len -= n;
+    }
+
+    return result;
+}
+
+// Zero-copy version of tee_fanout for a pipe on in_fd: every round tee(2) duplicates what is in the
+// input pipe into an empty scratch pipe per extra output, the scratch pipes are spliced to their
+// outputs and the last output consumes the input pipe itself. No data passes through user space
+// unless an output cannot take splice. Returns -1 without reading anything if in_fd is not a pipe
+// or the kernel does not support tee, so the caller can fall back to tee_fanout.
+// blocked (may be NULL) accumulates the time spent handing data to each output.
+int tee_fanout_zero_copy(int in_fd, int out_fds[], int out_count, unsigned long long* total_bytes, double blocked[])
+{
+    struct stat st;
+    if (fstat(in_fd, &st) == -1 || !S_ISFIFO(st.st_mode))
+        return -1;
+
+    // a scratch pipe can take everything the input pipe holds if it is at least as large
+    int capacity = fcntl(in_fd, F_GETPIPE_SZ);
+    if (capacity <= 0)
+        return -1;
+
+    int scratch[out_count][2];
+    int scratch_count = 0;
+    for (int i = 0; i < out_count - 1; i++)
+    {
+        if (pipe(scratch[i]) == -1)
+            break;
+        scratch_count++;
+        if (fcntl(scratch[i][1], F_SETPIPE_SZ, capacity) < capacity)
+            break;
+    }
+
+    char* buffer = malloc(TEE_BUFFER_SIZE); // only used for outputs that refuse splice
+    if (scratch_count < out_count - 1 || buffer == NULL)
+    {
+        for (int i = 0; i < scratch_count; i++)
+        {
+            close(scratch[i][0]);
+            close(scratch[i][1]);
+        }
+        free(buffer);
+        return -1;
+    }
+
+    int active[out_count];
+    for (int i = 0; i < out_count; i++)
+        active[i] = 1;
+
+    int result = 0;
+    int first_round = 1;
+    while (1)
+    {
+        // the first tee blocks until data arrives and decides how much this round moves
+        ssize_t n;
+        if (out_count > 1)
+            n = tee(in_fd, scratch[0][1], capacity, 0);
+        else
+            n = splice(in_fd, NULL, out_fds[0], NULL, capacity, SPLICE_F_MOVE);
+
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n == -1 && first_round && (errno == EINVAL || errno == ENOSYS))
+        {
+            result = -1; // nothing was read yet, let the caller copy instead
+            break;
+        }
+        if (n <= 0)
+            break;
+        first_round = 0;
+
+        if (out_count == 1)
+        {
+            *total_bytes += n;
+            continue;
+        }
+
+        // the input pipe still holds the same n bytes, duplicate them for every other scratch pipe
+        for (int i = 1; i < out_count - 1; i++)
+        {
+            if (!active[i])
+                continue;
+            ssize_t copied = tee(in_fd, scratch[i][1], n, 0);
+            if (copied != n)
+            {
+                fprintf(stderr, "my_tee: tee gave %zd of %zd bytes, dropping output %d\n", copied, n, i);
+                if (copied > 0)
+                    drain_pipe_to(scratch[i][0], -1, copied, buffer);
+                active[i] = 0;
+            }
+        }
+
+        // scratch[0] is filled by the first tee even for a dropped output, so it is always drained
+        struct timeval before, after;
+        for (int i = 0; i < out_count - 1; i++)
+        {
+            if (!active[i] && i > 0)
+                continue;
+            gettimeofday(&before, NULL);
+            if (drain_pipe_to(scratch[i][0], active[i] ? out_fds[i] : -1, n, buffer) == -1)
+                active[i] = 0;
+            gettimeofday(&after, NULL);
+            if (blocked != NULL)
+                blocked[i] += (after.tv_sec - before.tv_sec) + (after.tv_usec - before.tv_usec) / 1000000.0;
+        }
+
+        // finally consume the round from the input pipe into the last output
+        int last = out_count - 1;
+        gettimeofday(&before, NULL);
+        if (drain_pipe_to(in_fd, active[last] ? out_fds[last] : -1, n, buffer) == -1)
+            active[last] = 0;
+        gettimeofday(&after, NULL);
+        if (blocked != NULL)
+            blocked[last] += (after.tv_sec - before.tv_sec) + (after.tv_usec - before.tv_usec) / 1000000.0;
+
+        *total_bytes += n;
+    }
+
+    for (int i = 0; i < scratch_count; i++)
+    {
+        close(scratch[i][0]);
+        close(scratch[i][1]);
+    }
+    free(buffer);
+    return result;
+}
+
+// Copies in_fd to every fd of out_fds until end of input. An output that fails (a closed pipe,
+// a full disk) is dropped and the others keep going. Returns -1 if reading fails.
+// blocked (may be NULL) accumulates the time spent writing to each output.
+int tee_fanout(int in_fd, int out_fds[], int out_count, unsigned long long* total_bytes, double blocked[])
+{
+    char* buffer = malloc(TEE_BUFFER_SIZE);
+    if (buffer == NULL)
+    {
+        perror("malloc");
+        return -1;
+    }
+
+    int active[out_count];
+    for (int i = 0; i < out_count; i++)
+        active[i] = 1;
+
+    int result = 0;
+    while (1)
+    {
+        ssize_t n = read(in_fd, buffer, TEE_BUFFER_SIZE);
+        if (n == 0)
+            break;
+        if (n == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            perror("read");
+            result = -1;
+            break;
+        }
+
+        for (int i = 0; i < out_count; i++)
+        {
+            struct timeval before, after;
+            if (!active[i])
+                continue;
+            gettimeofday(&before, NULL);
+            if (write_all(out_fds[i], buffer, n) == -1)
+                active[i] = 0;
+            gettimeofday(&after, NULL);
+            if (blocked != NULL)
+                blocked[i] += (after.tv_sec - before.tv_sec) + (after.tv_usec - before.tv_usec) / 1000000.0;
+        }
+        *total_bytes += n;
+    }
+
+    free(buffer);
+    return result;
+}
+
+int set_rlimit(int resource_code, rlim_t soft_limit, rlim_t hard_limit)
+{
+    struct rlimit rl;
+    rl.rlim_cur = soft_limit;
+    rl.rlim_max = hard_limit;
+
+    //return 0 if successful, -1 if not
+    return setrlimit(resource_code, &rl);
+}
+
+// Converts "512", "100M", "1.5G", "2T" or "unlimited" to a limit value.
+// Fractions need a unit. Returns -1 on a malformed value, an unknown unit or overflow.
+int size_value(const char* value_str, rlim_t* value)
+{
+    if (strcmp(value_str, "unlimited") == 0)
+    {
+        *value = RLIM_INFINITY;
+        return 0;
+    }
+
+    if (!isdigit(value_str[0]))
+        return -1;
+
+    errno = 0;
+    char* end;
+    unsigned long long whole = strtoull(value_str, &end, 10);
+    if (errno == ERANGE)
+        return -1;
+
+    // keep the fraction as its own integer so whole values of any size stay exact
+    unsigned long long fraction = 0, fraction_scale = 1;
+    if (*end == '.')
+    {
+        end++;
+        if (!isdigit(*end))
+            return -1;
+        while (isdigit(*end))
+        {
+            if (fraction_scale < 1000000000ULL) // nine digits are plenty
+            {
+                fraction = fraction * 10 + (*end - '0');
+                fraction_scale *= 10;
+            }
+            end++;
+        }
+    }
+
+    // Get the unit part
+    const char* unit = end;
+    unsigned long long multiplier;
+
+    // Convert based on unit
+    if (strcmp(unit, "") == 0 || strcmp(unit, "B") == 0) {
+        multiplier = 1; // Bytes or a plain count
+    } else if (strcmp(unit, "K") == 0 || strcmp(unit, "KB") == 0) {
+        multiplier = BYTES_IN_KB; // Kilobytes
+    } else if (strcmp(unit, "M") == 0 || strcmp(unit, "MB") == 0) {
+        multiplier = BYTES_IN_MB; // Megabytes
+    } else if (strcmp(unit, "G") == 0 || strcmp(unit, "GB") == 0) {
+        multiplier = BYTES_IN_GB; // Gigabytes
+    } else if (strcmp(unit, "T") == 0 || strcmp(unit, "TB") == 0) {
+        multiplier = BYTES_IN_TB; // Terabytes
+    } else if (strcmp(unit, "P") == 0 || strcmp(unit, "PB") == 0) {
+        multiplier = BYTES_IN_PB; // Petabytes
+    } else {
+        return -1;
+    }
+
+    if (fraction_scale > 1 && multiplier == 1)
+        return -1; // "1.5" bytes or files makes no sense
+
+    // RLIM_INFINITY is the largest rlim_t, anything reaching it would silently mean unlimited
+    if (whole > (RLIM_INFINITY - 1) / multiplier)
+        return -1;
+    unsigned long long result = whole * multiplier;
+    unsigned long long fraction_part = fraction * (multiplier / fraction_scale) +
+                                       fraction * (multiplier % fraction_scale) / fraction_scale;
+    if (fraction_part > RLIM_INFINITY - 1 - result)
+        return -1;
+
+    *value = result + fraction_part;
+    return 0;
+}
+
+// Prints a limit value or "unlimited"
+void format_limit(rlim_t value, char* buffer, size_t size)
+{
+    if (value == RLIM_INFINITY)
+        snprintf(buffer, size, "unlimited");
+    else
+        snprintf(buffer, size, "%llu", (unsigned long long)value);
+}
+
+// Parses one "name=soft[:hard]" argument of rlimit set into a resource code and limit pair.
+// Returns 1 on success, 0 if the resource name is not one we support and -1 for a bad value
+// (malformed, overflowing or a soft limit above the hard one).
+int parse_rlimit_arg(const char* arg, int* resource_code, struct rlimit* limit)
+{
+    char resource_name[MAX_SIZE];
+    char value_str[MAX_SIZE];
+    const char* equal = strchr(arg, '=');
+
+    if (equal == NULL)
+        return 0;
+
+    strncpy(resource_name, arg, equal - arg);
+    resource_name[equal - arg] = '\0';
+    strcpy(value_str, equal + 1);
+
+    if (strcmp(resource_name, "cpu") == 0)
+        *resource_code = RLIMIT_CPU;
+    else if (strcmp(resource_name, "mem") == 0)
+        *resource_code = RLIMIT_AS;
+    else if (strcmp(resource_name, "fsize") == 0)
+        *resource_code = RLIMIT_FSIZE;
+    else if (strcmp(resource_name, "nofile") == 0)
+        *resource_code = RLIMIT_NOFILE;
+    else if (strcmp(resource_name, "pids") == 0)
+        *resource_code = RLIMIT_NPROC; // closest setrlimit has to pids.max, but it counts per user
+    else
+        return 0;
+
+    if (strchr(value_str, ':') != NULL)
+    {
+        char temp[MAX_SIZE];
+        strncpy(temp, value_str, strchr(value_str, ':') - value_str);
+        temp[strchr(value_str, ':') - value_str] = '\0';
+        if (size_value(temp, &limit->rlim_cur) == -1 || size_value(strchr(value_str, ':') + 1, &limit->rlim_max) == -1)
+            return -1;
+    }
+    else
+    {
+        if (size_value(value_str, &limit->rlim_cur) == -1)
+            return -1;
+        limit->rlim_max = limit->rlim_cur;
+    }
+
+    if (limit->rlim_cur > limit->rlim_max)
+        return -1;
+
+    return 1;
+}
+
+// Loads "name limit=soft[:hard] ..." lines into limit_profiles, parsed once so launching
+// a matching command only costs a lookup and the setrlimit calls. '#' starts a comment line.
+int load_limit_profiles(const char* filename)
+{
+    FILE* file = fopen(filename, "r");
+    if (file == NULL)
+    {
+        perror(filename);
+        return -1;
+    }
+
+    char line[MAX_SIZE];
+    int line_number = 0;
+    while (fgets(line, sizeof(line), file) != NULL)
+    {
+        line_number++;
+        line[strcspn(line, "\r\n")] = '\0';
+
+        char* name = strtok(line, " \t");
+        if (name == NULL || name[0] == '#')
+            continue;
+
+        if (profile_count >= MAX_PROFILES)
+        {
+            fprintf(stderr, "ERR: too many limit profiles in %s\n", filename);
+            fclose(file);
+            return -1;
+        }
+
+        struct limit_profile* profile = &limit_profiles[profile_count];
+        strncpy(profile->name, name, MAX_SIZE - 1);
+        profile->name[MAX_SIZE - 1] = '\0';
+        profile->count = 0;
+
+        char* arg;
+        while ((arg = strtok(NULL, " \t")) != NULL)
+        {
+            if (profile->count >= MAX_PROFILE_LIMITS ||
+                parse_rlimit_arg(arg, &profile->resources[profile->count], &profile->limits[profile->count]) != 1)
+            {
+                fprintf(stderr, "ERR: bad limit %s in %s line %d\n", arg, filename, line_number);
+                fclose(file);
+                return -1;
+            }
+            profile->count++;
+        }
+
+        profile_count++;
+    }
+
+    fclose(file);
+    return 0;
+}
+
+// Runs in the child before execvp: sets the limits of the profile named like the command, if any,
+// except for resources that also appear in overrides (the name=value arguments of rlimit set)
+void apply_limit_profile(const char* command_name, char* overrides[], int override_count)
+{
+    if (profile_count == 0 || command_name == NULL)
+        return;
+
+    const char* base = strrchr(command_name, '/'); // /usr/bin/make matches the make profile
+    base = base ? base + 1 : command_name;
+
+    for (int i = 0; i < profile_count; i++)
+    {
+        if (strcmp(limit_profiles[i].name, base) != 0)
+            continue;
+
+        for (int j = 0; j < limit_profiles[i].count; j++)
+        {
+            int overridden = 0;
+            for (int k = 0; k < override_count && !overridden; k++)
+            {
+                int resource_code;
+                struct rlimit limit;
+                overridden = parse_rlimit_arg(overrides[k], &resource_code, &limit) == 1 && resource_code == limit_profiles[i].resources[j];
+            }
+            if (overridden)
+                continue;
+
+            if (setrlimit(limit_profiles[i].resources[j], &limit_profiles[i].limits[j]) == -1)
+                perror("setrlimit");
+        }
+        return;
+    }
+}
+
+const char* rlimit_name(int resource_code)
+{
+    switch (resource_code)
+    {
+        case RLIMIT_CPU: return "cpu";
+        case RLIMIT_AS: return "mem";
+        case RLIMIT_FSIZE: return "fsize";
+        case RLIMIT_NOFILE: return "nofile";
+        case RLIMIT_NPROC: return "pids";
+        default: return "?";
+    }
+}
+
+void print_limit_profiles(void)
+{
+    for (int i = 0; i < profile_count; i++)
+    {
+        printf("%s:", limit_profiles[i].name);
+        for (int j = 0; j < limit_profiles[i].count; j++)
+        {
+            char soft[32], hard[32];
+            format_limit(limit_profiles[i].limits[j].rlim_cur, soft, sizeof(soft));
+            format_limit(limit_profiles[i].limits[j].rlim_max, hard, sizeof(hard));
+            printf(" %s=%s:%s", rlimit_name(limit_profiles[i].resources[j]), soft, hard);
+        }
+        printf("\n");
+    }
+}
+
+// mem, pids and cpuquota are the limits the cgroup backend takes over from setrlimit
+int is_cgroup_limit(const char* arg)
+{
+    return strncmp(arg, "mem=", 4) == 0 || strncmp(arg, "pids=", 5) == 0 || strncmp(arg, "cpuquota=", 9) == 0;
+}
+
+// Finds the cgroup v2 directory new command cgroups are created under:
+// $EX3_CGROUP_ROOT if set, else the cgroup the shell itself runs in.
+int find_cgroup_root(char* root, size_t size)
+{
+    const char* env_root = getenv("EX3_CGROUP_ROOT");
+    if (env_root != NULL)
+    {
+        snprintf(root, size, "%s", env_root);
+        return access(root, W_OK) == 0 ? 0 : -1;
+    }
+
+    FILE* file = fopen("/proc/self/cgroup", "r");
+    if (file == NULL)
+        return -1;
+
+    char line[MAX_SIZE];
+    char own_path[MAX_SIZE] = "";
+    while (fgets(line, sizeof(line), file) != NULL)
+    {
+        if (strncmp(line, "0::", 3) == 0) // the unified hierarchy entry
+        {
+            line[strcspn(line, "\n")] = '\0';
+            strcpy(own_path, line + 3);
+            break;
+        }
+    }
+    fclose(file);
+
+    if (own_path[0] == '\0')
+        return -1;
+
+    // pure v2 mounts at /sys/fs/cgroup, hybrid setups put it at /sys/fs/cgroup/unified
+    const char* mounts[] = { "/sys/fs/cgroup", "/sys/fs/cgroup/unified" };
+    for (int i = 0; i < 2; i++)
+    {
+        char controllers[PATH_MAX];
+        snprintf(root, size, "%s%s", mounts[i], strcmp(own_path, "/") == 0 ? "" : own_path);
+        snprintf(controllers, sizeof(controllers), "%s/cgroup.controllers", root);
+        if (access(controllers, F_OK) == 0)
+            return access(root, W_OK) == 0 ? 0 : -1;
+    }
+
+    return -1;
+}
+
+// Finds the cgroup root once and enables the memory, cpu and pids controllers for its children.
+// cgroup v2 refuses that while the cgroup holds processes itself (only the top one is exempt), so
+// when the root is the shell's own cgroup the shell first moves into the leaf <root>/ex3-shell,
+// which every ex3 started from that cgroup shares. Other processes left in the root still make it
+// fail; then the reason is printed once and -1 returned on every call, the caller uses setrlimit.
+int prepare_cgroup_root(char* root, size_t size)
+{
+    static int state = 0; // 0 not tried yet, 1 ready, -1 not possible
+    static char prepared[PATH_MAX];
+
+    if (state == 0)
+    {
+        state = -1;
+        if (find_cgroup_root(prepared, sizeof(prepared)) == -1)
+            fprintf(stderr, "WARNING: no writable cgroup v2 subtree, using setrlimit\n");
+        else if (cgroup_controllers_enabled(prepared))
+            state = 1;
+        else
+        {
+            int result = write_cgroup_file(prepared, "cgroup.subtree_control", CGROUP_CONTROLLERS);
+            if (result == -1 && errno == EBUSY && getenv("EX3_CGROUP_ROOT") == NULL)
+            {
+                char leaf[PATH_MAX + sizeof(CGROUP_SHELL_LEAF)];
+                char self[16];
+                snprintf(leaf, sizeof(leaf), "%s/%s", prepared, CGROUP_SHELL_LEAF);
+                snprintf(self, sizeof(self), "%d", (int)getpid());
+                if ((mkdir(leaf, 0755) == 0 || errno == EEXIST) && write_cgroup_file(leaf, "cgroup.procs", self) == 0)
+                    result = write_cgroup_file(prepared, "cgroup.subtree_control", CGROUP_CONTROLLERS);
+            }
+
+            if (result == 0 && cgroup_controllers_enabled(prepared))
+                state = 1;
+            else if (result == -1)
+                fprintf(stderr, "WARNING: cannot enable %s in %s (%s), using setrlimit\n", CGROUP_CONTROLLERS, prepared,
+                        errno == EBUSY ? "other processes are in it" : strerror(errno));
+            else
+                fprintf(stderr, "WARNING: %s did not stay enabled in %s, using setrlimit\n", CGROUP_CONTROLLERS, prepared);
+        }
+    }
+
+    if (state == -1)
+        return -1;
+    snprintf(root, size, "%s", prepared);
+    return 0;
+}
+
+// Whether dir's children get the memory, cpu and pids controllers
+int cgroup_controllers_enabled(const char* dir)
+{
+    char path[PATH_MAX];
+    char line[MAX_SIZE] = "";
+    snprintf(path, sizeof(path), "%s/cgroup.subtree_control", dir);
+
+    FILE* file = fopen(path, "r");
+    if (file == NULL)
+        return 0;
+    if (fgets(line, sizeof(line), file) == NULL)
+        line[0] = '\0';
+    fclose(file);
+
+    int found = 0;
+    for (char* word = strtok(line, " \n"); word != NULL; word = strtok(NULL, " \n"))
+        found += strcmp(word, "memory") == 0 || strcmp(word, "cpu") == 0 || strcmp(word, "pids") == 0;
+    return found == 3;
+}
+
+int write_cgroup_file(const char* dir, const char* file, const char* value)
+{
+    char path[PATH_MAX];
+    if (snprintf(path, sizeof(path), "%s/%s", dir, file) >= (int)sizeof(path))
+        return -1;
+
+    int fd = open(path, O_WRONLY);
+    if (fd == -1)
+        return -1;
+
+    ssize_t written = write(fd, value, strlen(value));
+    close(fd);
+    return written == (ssize_t)strlen(value) ? 0 : -1;
+}
+
+// cgroup files spell unlimited as "max"
+void cgroup_limit_value(rlim_t value, char* buffer, size_t size)
+{
+    if (value == RLIM_INFINITY)
+        snprintf(buffer, size, "max");
+    else
+        snprintf(buffer, size, "%llu", (unsigned long long)value);
+}
+
+// Creates a cgroup for one rlimit set command and writes its mem (memory.high:memory.max),
+// pids (pids.max) and cpuquota (percent of one cpu, cpu.max) limits from command[first..last).
+// Returns -1 and removes the cgroup again if any of it is not permitted, so the caller can fall back.
+int create_command_cgroup(char* command[], int first, int last, char* cg_dir, size_t size)
+{
+    static int warned = 0;
+    char root[PATH_MAX];
+
+    if (prepare_cgroup_root(root, sizeof(root)) == -1)
+    {
+        warned = 1; // prepare_cgroup_root said why
+        return -1;
+    }
+
+    snprintf(cg_dir, size, "%s/ex3-%d-%d", root, (int)getpid(), ++cgroup_counter);
+    if (mkdir(cg_dir, 0755) == -1)
+    {
+        if (!warned)
+            perror("cgroup mkdir");
+        warned = 1;
+        return -1;
+    }
+
+    for (int i = first; i < last; i++)
+    {
+        char value[MAX_SIZE];
+        const char* arg = command[i];
+        int error = 0;
+
+        if (strncmp(arg, "mem=", 4) == 0)
+        {
+            int resource_code;
+            struct rlimit limit;
+            error = parse_rlimit_arg(arg, &resource_code, &limit) == 1 ? 0 : -1;
+            if (!error && strchr(arg, ':') != NULL)
+            {
+                cgroup_limit_value(limit.rlim_cur, value, sizeof(value));
+                error |= write_cgroup_file(cg_dir, "memory.high", value);
+            }
+            cgroup_limit_value(limit.rlim_max, value, sizeof(value));
+            error |= write_cgroup_file(cg_dir, "memory.max", value);
+        }
+        else if (strncmp(arg, "pids=", 5) == 0)
+        {
+            rlim_t pids;
+            error = size_value(arg + 5, &pids);
+            cgroup_limit_value(pids, value, sizeof(value));
+            error |= write_cgroup_file(cg_dir, "pids.max", value);
+        }
+        else if (strncmp(arg, "cpuquota=", 9) == 0)
+        {
+            double percent;
+            error = parse_cpuquota(arg, &percent);
+            if (!error)
+            {
+                snprintf(value, sizeof(value), "%ld 100000", (long)(percent * 1000));
+                error |= write_cgroup_file(cg_dir, "cpu.max", value);
+            }
+        }
+
+        if (error)
+        {
+            if (!warned)
+                fprintf(stderr, "WARNING: cannot set %s in cgroup %s, using setrlimit\n", arg, cg_dir);
+            warned = 1;
+            rmdir(cg_dir);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+// Prints peak memory, cpu throttling and oom kills of a finished command's cgroup, then removes it
+void report_command_cgroup(const char* cg_dir)
+{
+    char path[PATH_MAX];
+    char buffer[MAX_SIZE];
+    unsigned long long peak = 0, throttled_usec = 0, oom_kills = 0;
+    int have_peak = 0;
+
+    snprintf(path, sizeof(path), "%s/memory.peak", cg_dir); // kernel 5.19 and newer
+    FILE* file = fopen(path, "r");
+    if (file != NULL)
+    {
+        have_peak = fscanf(file, "%llu", &peak) == 1;
+        fclose(file);
+    }
+
+    snprintf(path, sizeof(path), "%s/cpu.stat", cg_dir);
+    file = fopen(path, "r");
+    if (file != NULL)
+    {
+        while (fgets(buffer, sizeof(buffer), file) != NULL)
+            sscanf(buffer, "throttled_usec %llu", &throttled_usec);
+        fclose(file);
+    }
+
+    snprintf(path, sizeof(path), "%s/memory.events", cg_dir);
+    file = fopen(path, "r");
+    if (file != NULL)
+    {
+        while (fgets(buffer, sizeof(buffer), file) != NULL)
+            sscanf(buffer, "oom_kill %llu", &oom_kills);
+        fclose(file);
+    }
+
+    if (have_peak)
+        printf("cgroup: peak_mem=%llu throttled=%.5f sec oom_kills=%llu\n", peak, throttled_usec / 1000000.0, oom_kills);
+    else
+        printf("cgroup: peak_mem=n/a throttled=%.5f sec oom_kills=%llu\n", throttled_usec / 1000000.0, oom_kills);
+
+    // fails if a descendant is still alive in there, the cgroup is then left for the admin
+    rmdir(cg_dir);
+}
+
+void print_rlimit_arg_error(const char* arg, int result)
+{
+    if (result == 0)
+        fprintf(stderr, "ERR: Not a valid resource\n");
+    else
+        fprintf(stderr, "ERR: Not a valid limit value (%s)\n", arg);
+}
+
+// "cpuquota=<percent of one cpu>", a positive number; -1 for anything else
+int parse_cpuquota(const char* arg, double* percent)
+{
+    char* end;
+    *percent = strtod(arg + 9, &end);
+    return end == arg + 9 || *end != '\0' || !(*percent > 0) || *percent > 1e9 ? -1 : 0;
+}
+
+// Turns "1234" or "%2" (job number as listed by jobs) into a pid, -1 if there is no such job
+pid_t resolve_job_pid(const char* spec)
+{
+    if (spec[0] == '%')
+    {
+        int job = atoi(spec + 1);
+        if (job < 1 || job > bg_count)
+            return -1;
+        return bg_processes[job - 1].pid;
+    }
+
+    for (int i = 0; spec[i] != '\0'; i++)
+    {
+        if (!isdigit(spec[i]))
+            return -1;
+    }
+
+    return (pid_t)atoi(spec);
+}
+
+// Prints the cpu, memory, file size and open files limits of pid (0 for the shell itself)
+int print_rlimits(pid_t pid)
+{
+    struct rlimit cpu_rl, mem_rl,fsize_rl,files_rl;
+
+    // Get CPU, memory, size and open files limits
+    if (prlimit(pid, RLIMIT_CPU, NULL, &cpu_rl) == -1 ||
+        prlimit(pid, RLIMIT_AS, NULL, &mem_rl) == -1 ||
+        prlimit(pid, RLIMIT_FSIZE, NULL, &fsize_rl) == -1 ||
+        prlimit(pid, RLIMIT_NOFILE, NULL, &files_rl) == -1)
+        return -1;
+
+    // Print the limits, soft and hard separately since only one of them may be unlimited
+    struct rlimit* limits[] = { &cpu_rl, &mem_rl, &fsize_rl, &files_rl };
+    const char* labels[] = { "CPU time", "Memory", "File size", "Open files" };
+
+    for (int i = 0; i < 4; i++)
+    {
+        char soft[32], hard[32];
+        format_limit(limits[i]->rlim_cur, soft, sizeof(soft));
+        format_limit(limits[i]->rlim_max, hard, sizeof(hard));
+
+        const char* unit = i == 0 ? "s" : ""; // cpu limit is in seconds
+        printf("%s: soft=%s%s, hard=%s%s\n", labels[i], soft, limits[i]->rlim_cur == RLIM_INFINITY ? "" : unit,
+               hard, limits[i]->rlim_max == RLIM_INFINITY ? "" : unit);
+    }
+
+    return 0;
+}
+
+int handle_rlimit(char* command[], int arg_count, FILE* exec_times, int* cmd, double* total_time, double* last_cmd_time, double* avg_time, double* min_time, double* max_time)
+{
+    if (arg_count < 2)
+        return 0;
+
+    int resource_code; //0 for cpu, 1 for memory, 2 for size, 3 for files
+
+    if (strcmp(command[1], "show") == 0)
+    {
+        // Either "rlimit show" for the shell itself or "rlimit show pid=<pid|%job>"
+        pid_t target = 0;
+        if (arg_count == 3 && strncmp(command[2], "pid=", 4) == 0)
+        {
+            target = resolve_job_pid(command[2] + 4);
+            if (target <= 0)
+            {
+                printf("ERR: No such process\n");
+                return 0;
+            }
+        }
+        else if (arg_count != 2) 
+        {
+            return 0;
+        }
+
+        struct timeval start, end;
+        gettimeofday(&start, NULL);
+
+        if (print_rlimits(target) == -1)
+        {
+            perror("prlimit");
+            return 0;
+        }
+
+        gettimeofday(&end, NULL);
+        double runtime = (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1000000.0;
+
+        // Update timing statistics using the new function
+        update_timing_stats(runtime, "rlimit show");
+
+        for (int i = 0; command[i] != NULL; i++) {
+        free(command[i]);
+        command[i] = NULL;
+    }
+
+        return 1;
+    }
+    
+    if (strcmp(command[1], "profile") == 0)
+    {
+        if (arg_count != 2)
+        {
+            printf("ERR\n");
+            return 0;
+        }
+        print_limit_profiles();
+        return 1;
+    }
+
+    // rlimit backend [cgroup|setrlimit] - choose how rlimit set confines new commands
+    if (strcmp(command[1], "backend") == 0)
+    {
+        if (arg_count == 2)
+            printf("%s\n", rlimit_backend_cgroup ? "cgroup" : "setrlimit");
+        else if (arg_count == 3 && strcmp(command[2], "cgroup") == 0)
+            rlimit_backend_cgroup = 1;
+        else if (arg_count == 3 && strcmp(command[2], "setrlimit") == 0)
+            rlimit_backend_cgroup = 0;
+        else
+        {
+            printf("ERR\n");
+            return 0;
+        }
+        return 1;
+    }
+
+    if (strcmp(command[1], "set") == 0)
+    {
+        if (arg_count < 3)
+        {
+            printf("ERR\n");
+            return 0;
+        }
+
+        // "rlimit set pid=<pid|%job> ..." re-limits a process that is already running
+        if (strncmp(command[2], "pid=", 4) == 0)
+        {
+            struct timeval start, end;
+            gettimeofday(&start, NULL);
+
+            pid_t target = resolve_job_pid(command[2] + 4);
+            if (target <= 0 || arg_count < 4)
+            {
+                printf("ERR\n");
+                return 0;
+            }
+
+            // every argument is checked before any is applied, a typo leaves the process as it was
+            int resources[MAX_ARG];
+            struct rlimit limits[MAX_ARG];
+            for (int i = 3; i < arg_count; i++)
+            {
+                int result = parse_rlimit_arg(command[i], &resources[i - 3], &limits[i - 3]);
+                if (result != 1)
+                {
+                    print_rlimit_arg_error(command[i], result);
+                    return 0;
+                }
+            }
+
+            for (int i = 0; i < arg_count - 3; i++)
+            {
+                if (prlimit(target, resources[i], &limits[i], NULL) == -1)
+                {
+                    perror("prlimit");
+                    return 0;
+                }
+            }
+
+            gettimeofday(&end, NULL);
+            double runtime = (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1000000.0;
+            update_timing_stats(runtime, "rlimit set");
+            return 1;
+        }
+
+        // Find where the actual command starts after the resource limits
+        int cmd_start = 2;
+        for (; cmd_start < arg_count; cmd_start++) {
+            if (strchr(command[cmd_start], '=') == NULL) {
+                break;
+            }
+        }
+
+        // If no command after limits, return error
+        if (cmd_start >= arg_count) {
+            printf("ERR\n");  // No command provided after limits
+            return 0;
+        }
+
+        // Validate every limit before anything is forked, so a typo never runs the command unconfined
+        int cpuquota = 0;
+        for (int i = 2; i < cmd_start; i++)
+        {
+            struct rlimit limit;
+            double percent;
+            int result;
+            if (strncmp(command[i], "cpuquota=", 9) == 0)
+            {
+                result = parse_cpuquota(command[i], &percent) == 0 ? 1 : -1;
+                cpuquota = 1;
+            }
+            else
+                result = parse_rlimit_arg(command[i], &resource_code, &limit);
+            if (result != 1)
+            {
+                print_rlimit_arg_error(command[i], result);
+                return 0;
+            }
+        }
+
+        // With the cgroup backend mem, pids and cpuquota go to a cgroup of their own that also
+        // holds every descendant, otherwise everything falls back to setrlimit in the child.
+        // setrlimit has nothing like cpuquota, a command asking for one is not run without it.
+        char cg_dir[PATH_MAX];
+        int use_cgroup = rlimit_backend_cgroup && create_command_cgroup(command, 2, cmd_start, cg_dir, sizeof(cg_dir)) == 0;
+        if (cpuquota && !use_cgroup)
+        {
+            fprintf(stderr, "ERR: cpuquota needs the cgroup backend\n");
+            return 0;
+        }
+
+        int perf_gate[2] = { -1, -1 };
+        int perf_fds[PERF_EVENTS];
+        if (perf_enabled && perf_gate_open(perf_gate) == -1)
+            perror("pipe");
+
+        // If we have a command, fork and run it with the new limits
+        pid_t pid = fork();
+        if (pid < 0) {
+            perror("fork");
+            if (perf_gate[0] != -1)
+            {
+                close(perf_gate[0]);
+                close(perf_gate[1]);
+            }
+            return 0;
+        }
+        else if (pid == 0) {
+            perf_gate_wait(perf_gate);
+
+            // Child process - set up signal handlers first
+            signal(SIGXCPU, handle_sigcpu);
             signal(SIGXFSZ, handle_sigfsz);
             signal(SIGSEGV, handle_sigmem);
             signal(SIGUSR1, handle_signof);
 
-            for (int i = 2; i < cmd_start; i++)
-            {
-                char resource_name[MAX_SIZE];
-                char value_str[MAX_SIZE];
-                int hard_limit;
-                int soft_limit;
+            // limits given on the line win over the ones of the command's profile
+            apply_limit_profile(command[cmd_start], &command[2], cmd_start - 2);
+
+            if (use_cgroup && write_cgroup_file(cg_dir, "cgroup.procs", "0") == -1)
+            {
+                perror("cgroup.procs");
+                exit(1);
+            }
+
+            for (int i = 2; i < cmd_start; i++)
+            {
+                if (use_cgroup && is_cgroup_limit(command[i]))
+                    continue; // already written to the cgroup
+
+                struct rlimit limit;
+                int result = parse_rlimit_arg(command[i], &resource_code, &limit);
+                if (result != 1)
+                {
+                    print_rlimit_arg_error(command[i], result);
+                    exit(1);
+                }
+
+                if (set_rlimit(resource_code, limit.rlim_cur, limit.rlim_max) == -1) 
+                {
+                    perror("setrlimit");
+                    exit(1);
+                }
+            }
+
+            // Create new array for the command
+            char* new_command[MAX_ARG + 1];
+            int new_index = 0;
+            
+            // Initialize new_command array to NULL
+            for (int i = 0; i <= MAX_ARG; i++) {
+                new_command[i] = NULL;
+            }
+            
+            // Copy the command and its arguments
+            for (int i = cmd_start; i < arg_count; i++) {
+                new_command[new_index++] = command[i];
+            }
+            new_command[new_index] = NULL;
+
+            check_dangerous_command(new_command[0], new_command, arg_count);
+            apply_sched_profile(0);
+
+            struct redirections redirect;
+            if (parse_redirections(new_command, new_index, &redirect) == -1) {
+                fprintf(stderr, "ERR: bad redirection\n");
+                exit(1);
+            }
+            if (apply_redirections(&redirect) == -1) {
+                exit(1);
+            }
+
+            execvp(new_command[0], new_command);
+            perror("execvp");
+            exit(1);
+        }
+        else {
+            // Parent process
+            int status;
+            struct rusage usage;
+            struct timeval start, end;
+            char counters[PERF_DETAIL_SIZE];
+            gettimeofday(&start, NULL);
+            perf_attach(pid, perf_gate, perf_fds);
+            wait4(pid, &status, 0, &usage);
+            gettimeofday(&end, NULL);
+            perf_read(perf_fds, counters, sizeof(counters));
+            double runtime = (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1000000.0;
+
+            if (use_cgroup)
+                report_command_cgroup(cg_dir);
+            if (trace_fd != -1)
+                trace_span("command", command[cmd_start], pid, timeval_us(&start), timeval_us(&end), "\"rlimit\":1");
+
+            if (check_process_status(status, pid, command[cmd_start], exec_times, runtime, 0)) {
+                // Update timing statistics using the new function
+                update_timing_stats_result(runtime, command[cmd_start], counters[0] != '\0' ? counters : NULL, status, &usage);
+            }
+            else {
+                update_failure_stats(command[cmd_start], runtime, status, &usage);
+            }
+
+            for (int i = 0; i < arg_count; i++)
+            {
+            free(command[i]);
+            command[i] = NULL;
+            }
+        }
+
+        return 1;
+    }
+    return 0;
+}
+
+void handle_sigcpu(int signo)
+{
+    printf("CPU time limit exceeded!\n");
+    exit(1);
+}
+
+void handle_sigfsz(int signo)
+{
+    printf("File size limit exceeded!\n");
+    exit(1);
+}
+
+void handle_sigmem(int signo)
+{
+    printf("Memory allocation failed!\n");
+    exit(1);
+}
+
+void handle_signof(int signo)
+{
+    printf("Too many open files!\n");
+    exit(1);
+}
+
+void handle_sigterm(int signo)
+{
+    log_terminate = 1;
+    log_wake();
+}
+
+void handle_sigchild(int signo) {
+    pid_t pid;
+    int status;
+    struct rusage usage;
+    in_sigchild = 1;
+    while ((pid = wait4(-1, &status, WNOHANG, &usage)) > 0) {
+        // Find the background process in our array
+        for (int i = 0; i < bg_count; i++) {
+            if (bg_processes[i].pid == pid) {
+                // Calculate runtime
+                struct timeval end;
+                gettimeofday(&end, NULL);
+                double runtime = (end.tv_sec - bg_processes[i].start_time.tv_sec) + 
+                               (end.tv_usec - bg_processes[i].start_time.tv_usec) / 1000000.0;
+                
+                char counters[PERF_DETAIL_SIZE];
+                perf_read(bg_processes[i].perf_fds, counters, sizeof(counters));
+
+                // Check process status and handle accordingly
+                int success = check_process_status(status, pid, bg_processes[i].command, global_exec_times, runtime, 1);
+                if (trace_fd != -1)
+                    trace_span("background", bg_processes[i].command, pid, timeval_us(&bg_processes[i].start_time), timeval_us(&end), NULL);
+                
+                if (success) {
+                    // Success case - update stats
+                    update_timing_stats_result(runtime, bg_processes[i].command, counters[0] != '\0' ? counters : NULL, status, &usage);
+                }
+                else {
+                    update_failure_stats(bg_processes[i].command, runtime, status, &usage);
+                }
+                
+                // Print the prompt with updated or unchanged stats
+                printf("\n");
+                print_prompt();
+                fflush(stdout);
+                
+                // Remove the completed process from our array
+                for (int j = i; j < bg_count - 1; j++) {
+                    bg_processes[j] = bg_processes[j + 1];
+                }
+                bg_count--;
+                break;
+            }
+        }
+    }
+    in_sigchild = 0;
+}
+
+// Reads cpu, memory, io and thread counters of a live background process from /proc.
+// Nothing runs between calls, the cpu percentage is the delta since the previous sample
+// (or since launch for the first one), so an idle shell pays nothing for this.
+int sample_bg_process(struct bg_process* proc, double* cpu_percent, long* rss_kb, unsigned long long* io_read, unsigned long long* io_write, int* threads)
+{
+    char path[64];
+    char buffer[MAX_SIZE];
+
+    snprintf(path, sizeof(path), "/proc/%d/stat", (int)proc->pid);
+    int fd = open(path, O_RDONLY);
+    if (fd == -1)
+        return 0;
+    ssize_t n = read(fd, buffer, sizeof(buffer) - 1);
+    close(fd);
+    if (n <= 0)
+        return 0;
+    buffer[n] = '\0';
+
+    // the command name can hold spaces and ')' so the fields start after the last ')'
+    char* fields = strrchr(buffer, ')');
+    if (fields == NULL)
+        return 0;
+
+    unsigned long utime, stime;
+    long num_threads, rss_pages;
+    if (sscanf(fields + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu %*d %*d %*d %*d %ld %*d %*u %*u %ld",
+               &utime, &stime, &num_threads, &rss_pages) != 4)
+        return 0;
+
+    struct timeval now;
+    gettimeofday(&now, NULL);
+
+    unsigned long long ticks = (unsigned long long)utime + stime;
+    struct timeval since = timerisset(&proc->last_sample) ? proc->last_sample : proc->start_time;
+    unsigned long long since_ticks = timerisset(&proc->last_sample) ? proc->last_cpu_ticks : 0;
+    double elapsed = (now.tv_sec - since.tv_sec) + (now.tv_usec - since.tv_usec) / 1000000.0;
+
+    *cpu_percent = 0;
+    if (elapsed > 0)
+        *cpu_percent = (ticks - since_ticks) / (double)sysconf(_SC_CLK_TCK) / elapsed * 100.0;
+
+    proc->last_cpu_ticks = ticks;
+    proc->last_sample = now;
+
+    *threads = (int)num_threads;
+    *rss_kb = rss_pages * (sysconf(_SC_PAGESIZE) / BYTES_IN_KB);
+
+    // io counters are optional - /proc/<pid>/io needs CONFIG_TASK_IO_ACCOUNTING
+    *io_read = 0;
+    *io_write = 0;
+    snprintf(path, sizeof(path), "/proc/%d/io", (int)proc->pid);
+    fd = open(path, O_RDONLY);
+    if (fd != -1)
+    {
+        n = read(fd, buffer, sizeof(buffer) - 1);
+        close(fd);
+        if (n > 0)
+        {
+            buffer[n] = '\0';
+            char* line = strstr(buffer, "rchar:");
+            if (line != NULL)
+                sscanf(line, "rchar: %llu", io_read);
+            line = strstr(buffer, "wchar:");
+            if (line != NULL)
+                sscanf(line, "wchar: %llu", io_write);
+        }
+    }
+
+    return 1;
+}
+
+void handle_jobs(char* command[], int arg_count)
+{
+    int verbose = 0;
+
+    if (arg_count == 2 && strcmp(command[1], "-v") == 0)
+        verbose = 1;
+    else if (arg_count != 1)
+    {
+        printf("ERR\n");
+        return;
+    }
+
+    struct timeval start, end;
+    gettimeofday(&start, NULL);
+
+    // the SIGCHLD handler removes entries from bg_processes, keep it out while we walk the array
+    sigset_t block, old;
+    sigemptyset(&block);
+    sigaddset(&block, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &block, &old);
+
+    for (int i = 0; i < bg_count; i++)
+    {
+        struct bg_process* proc = &bg_processes[i];
+        double elapsed = (start.tv_sec - proc->start_time.tv_sec) + (start.tv_usec - proc->start_time.tv_usec) / 1000000.0;
+
+        if (!verbose)
+        {
+            printf("[%d] %d running %.2fs %s\n", i + 1, (int)proc->pid, elapsed, proc->command);
+            continue;
+        }
+
+        double cpu_percent;
+        long rss_kb;
+        unsigned long long io_read, io_write;
+        int threads;
+
+        if (!sample_bg_process(proc, &cpu_percent, &rss_kb, &io_read, &io_write, &threads))
+        {
+            printf("[%d] %d exited %.2fs %s\n", i + 1, (int)proc->pid, elapsed, proc->command);
+            continue;
+        }
+
+        printf("[%d] %d cpu=%.1f%% rss=%ldK io_read=%llu io_write=%llu threads=%d elapsed=%.2fs %s\n",
+               i + 1, (int)proc->pid, cpu_percent, rss_kb, io_read, io_write, threads, elapsed, proc->command);
+    }
+
+    sigprocmask(SIG_SETMASK, &old, NULL);
+
+    gettimeofday(&end, NULL);
+    double runtime = (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1000000.0;
+    update_timing_stats(runtime, "jobs");
+}
+
+// Parses one sched key=value argument into profile:
+// cpus=0-3,6|all nice=N policy=other|batch|idle ioprio=rt:N|be:N|idle|none
+// Returns 0 on a bad key or value.
+int parse_sched_arg(const char* arg, struct sched_profile* profile)
+{
+    const char* value = strchr(arg, '=');
+    if (value == NULL || value[1] == '\0')
+        return 0;
+    value++;
+
+    if (strncmp(arg, "cpus=", 5) == 0)
+    {
+        CPU_ZERO(&profile->cpus);
+        profile->reset_cpus = strcmp(value, "all") == 0;
+        if (profile->reset_cpus)
+        {
+            profile->has_cpus = 0;
+            return 1;
+        }
+
+        const char* p = value;
+        while (*p != '\0')
+        {
+            char* end;
+            long first = strtol(p, &end, 10);
+            long last = first;
+            if (end == p || first < 0)
+                return 0;
+            if (*end == '-')
+            {
+                p = end + 1;
+                last = strtol(p, &end, 10);
+                if (end == p || last < first)
+                    return 0;
+            }
+            if (last >= CPU_SETSIZE)
+                return 0;
+            for (long cpu = first; cpu <= last; cpu++)
+                CPU_SET(cpu, &profile->cpus);
+
+            if (*end == ',')
+                end++;
+            else if (*end != '\0')
+                return 0;
+            p = end;
+        }
+        profile->has_cpus = 1;
+        return 1;
+    }
+
+    if (strncmp(arg, "nice=", 5) == 0)
+    {
+        char* end;
+        long nice_value = strtol(value, &end, 10);
+        if (*end != '\0' || nice_value < -20 || nice_value > 19)
+            return 0;
+        profile->nice = (int)nice_value;
+        profile->has_nice = 1;
+        return 1;
+    }
+
+    if (strncmp(arg, "policy=", 7) == 0)
+    {
+        if (strcmp(value, "other") == 0)
+            profile->policy = SCHED_OTHER;
+        else if (strcmp(value, "batch") == 0)
+            profile->policy = SCHED_BATCH;
+        else if (strcmp(value, "idle") == 0)
+            profile->policy = SCHED_IDLE;
+        else
+            return 0;
+        profile->has_policy = 1;
+        return 1;
+    }
+
+    if (strncmp(arg, "ioprio=", 7) == 0)
+    {
+        profile->reset_ioprio = strcmp(value, "none") == 0;
+        if (profile->reset_ioprio)
+        {
+            profile->has_ioprio = 0;
+            return 1;
+        }
+        if (strcmp(value, "idle") == 0)
+        {
+            profile->ioprio = IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT;
+            profile->has_ioprio = 1;
+            return 1;
+        }
+
+        int io_class;
+        if (strncmp(value, "rt:", 3) == 0)
+            io_class = IOPRIO_CLASS_RT;
+        else if (strncmp(value, "be:", 3) == 0)
+            io_class = IOPRIO_CLASS_BE;
+        else
+            return 0;
+
+        if (!isdigit(value[3]) || value[4] != '\0') // levels are 0 (highest) to 7
+            return 0;
+        int level = value[3] - '0';
+        if (level > 7)
+            return 0;
+
+        profile->ioprio = (io_class << IOPRIO_CLASS_SHIFT) | level;
+        profile->has_ioprio = 1;
+        return 1;
+    }
+
+    return 0;
+}
+
+// Removes "sched run key=value ..." from the front of input, leaving only the command.
+// Returns -1 on a bad option or when no command follows.
+int strip_sched_run(char* input, struct sched_profile* profile)
+{
+    char* p = input + 10; // skip "sched run "
+
+    while (*p != '\0')
+    {
+        char* space = strchr(p, ' ');
+        int len = space ? (int)(space - p) : (int)strlen(p);
+        char arg[MAX_SIZE];
+
+        strncpy(arg, p, len);
+        arg[len] = '\0';
+        if (strchr(arg, '=') == NULL) // first word that is not an option starts the command
+            break;
+        if (!parse_sched_arg(arg, profile))
+            return -1;
+
+        p += len;
+        if (*p == ' ')
+            p++;
+    }
+
+    if (*p == '\0')
+        return -1;
+
+    memmove(input, p, strlen(p) + 1);
+    return 0;
+}
+
+// Runs in the child before execvp: applies the session profile (bg_sched for & jobs,
+// fg_sched otherwise) with the "sched run" overrides of this line on top.
+// Failures are reported but do not stop the command from running.
+void apply_sched_profile(int background)
+{
+    struct sched_profile profile = background ? bg_sched : fg_sched;
+
+    if (command_sched.has_cpus || command_sched.reset_cpus)
+    {
+        profile.has_cpus = command_sched.has_cpus;
+        profile.cpus = command_sched.cpus;
+    }
+    if (command_sched.has_nice)
+    {
+        profile.has_nice = 1;
+        profile.nice = command_sched.nice;
+    }
+    if (command_sched.has_policy)
+    {
+        profile.has_policy = 1;
+        profile.policy = command_sched.policy;
+    }
+    if (command_sched.has_ioprio || command_sched.reset_ioprio)
+    {
+        profile.has_ioprio = command_sched.has_ioprio;
+        profile.ioprio = command_sched.ioprio;
+    }
+
+    if (profile.has_cpus && sched_setaffinity(0, sizeof(profile.cpus), &profile.cpus) == -1)
+        perror("sched_setaffinity");
+
+    if (profile.has_policy)
+    {
+        struct sched_param param = { .sched_priority = 0 };
+        if (sched_setscheduler(0, profile.policy, &param) == -1)
+            perror("sched_setscheduler");
+    }
+
+    if (profile.has_nice && setpriority(PRIO_PROCESS, 0, profile.nice) == -1)
+        perror("setpriority");
+
+    if (profile.has_ioprio && syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, profile.ioprio) == -1)
+        perror("ioprio_set");
+}
+
+void print_sched_profile(const char* name, const struct sched_profile* profile)
+{
+    printf("%s: cpus=", name);
+    if (!profile->has_cpus)
+        printf("all");
+    else
+    {
+        int first = 1;
+        for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+        {
+            if (!CPU_ISSET(cpu, &profile->cpus))
+                continue;
+            int last = cpu;
+            while (last + 1 < CPU_SETSIZE && CPU_ISSET(last + 1, &profile->cpus))
+                last++;
+            printf(first ? "%d" : ",%d", cpu);
+            if (last > cpu)
+                printf("-%d", last);
+            first = 0;
+            cpu = last;
+        }
+    }
+
+    if (profile->has_nice)
+        printf(" nice=%d", profile->nice);
+    else
+        printf(" nice=inherit");
+
+    const char* policy = "inherit";
+    if (profile->has_policy)
+        policy = profile->policy == SCHED_BATCH ? "batch" : profile->policy == SCHED_IDLE ? "idle" : "other";
+    printf(" policy=%s", policy);
+
+    if (!profile->has_ioprio)
+        printf(" ioprio=none\n");
+    else if ((profile->ioprio >> IOPRIO_CLASS_SHIFT) == IOPRIO_CLASS_IDLE)
+        printf(" ioprio=idle\n");
+    else
+        printf(" ioprio=%s:%d\n", (profile->ioprio >> IOPRIO_CLASS_SHIFT) == IOPRIO_CLASS_RT ? "rt" : "be",
+               profile->ioprio & ((1 << IOPRIO_CLASS_SHIFT) - 1));
+}
+
+// sched show | sched set fg|bg key=value ...
+void handle_sched(char* command[], int arg_count)
+{
+    struct timeval start, end;
+    gettimeofday(&start, NULL);
+
+    if (arg_count == 2 && strcmp(command[1], "show") == 0)
+    {
+        print_sched_profile("fg", &fg_sched);
+        print_sched_profile("bg", &bg_sched);
+    }
+    else if (arg_count >= 4 && strcmp(command[1], "set") == 0 &&
+             (strcmp(command[2], "fg") == 0 || strcmp(command[2], "bg") == 0))
+    {
+        // parse into a copy so a bad argument leaves the session profile untouched
+        struct sched_profile* target = strcmp(command[2], "fg") == 0 ? &fg_sched : &bg_sched;
+        struct sched_profile profile = *target;
+
+        for (int i = 3; i < arg_count; i++)
+        {
+            if (!parse_sched_arg(command[i], &profile))
+            {
+                printf("ERR\n");
+                return;
+            }
+        }
+        *target = profile;
+    }
+    else
+    {
+        printf("ERR\n");
+        return;
+    }
+
+    gettimeofday(&end, NULL);
+    double runtime = (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1000000.0;
+    update_timing_stats(runtime, "sched");
+}
+
+// Function to handle time measurements and update statistics
+void update_timing_stats(double runtime, const char* command_name)
+{
+    if (trace_fd != -1)
+    {
+        uint64_t now = realtime_us();
+        trace_span("builtin", command_name, gettid(), now - (uint64_t)(runtime * 1e6), now, NULL);
+    }
+    update_timing_stats_detail(runtime, command_name, NULL);
+}
+
+// Same as update_timing_stats, with extra information appended to the exec_times record in parentheses
+void update_timing_stats_detail(double runtime, const char* command_name, const char* detail)
+{
+    update_timing_stats_result(runtime, command_name, detail, 0, NULL);
+}
+
+// Same as update_timing_stats_detail for a reaped child: its wait status and rusage go to the
+// --binlog record (usage is NULL for whatever ran inside the shell)
+void update_timing_stats_result(double runtime, const char* command_name, const char* detail, int status, const struct rusage* usage)
+{
+    cmd++;
+    last_cmd_time = runtime;
+    total_time += runtime;
+    avg_time = total_time / cmd;
+
+    if (runtime > max_time)
+        max_time = runtime;
+
+    if (runtime < min_time || min_time == 0)
+        min_time = runtime;
+
+    latency_record(runtime);
+    command_stats_record(command_name, runtime, !WIFEXITED(status) || WEXITSTATUS(status) != 0);
+
+    // Queue the exec_times record, the logger thread writes it
+    if (detail != NULL)
+        log_record("%s : %.5f sec (%s)\n", command_name, runtime, detail);
+    else
+        log_record("%s : %.5f sec\n", command_name, runtime);
+
+    binlog_record(command_name, runtime, status, usage);
+}
+
+// A command that failed leaves the prompt statistics alone but counts for its name and the binlog
+void update_failure_stats(const char* command_name, double runtime, int status, const struct rusage* usage)
+{
+    command_stats_record(command_name, runtime, 1);
+    binlog_record(command_name, runtime, status, usage);
+}
+
+void print_prompt(void)
+{
+    // handle_sigchild adds to the histograms, keep it out while we read them
+    sigset_t block, old;
+    sigemptyset(&block);
+    sigaddset(&block, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &block, &old);
+
+    const struct latency_histogram* latency = &all_latency;
+    double max = max_time;
+    if (window_limit > 0 || window_seconds > 0)
+    {
+        window_expire(monotonic_seconds());
+        latency = &window_latency;
+        max = 0;
+    }
+
+    double p50 = latency_percentile(latency, 0.50, max);
+    double p95 = latency_percentile(latency, 0.95, max);
+    double p99 = latency_percentile(latency, 0.99, max);
+    double stddev = latency_stddev(latency);
+    shm_publish_prompt(p50, p95, p99);
+    sigprocmask(SIG_SETMASK, &old, NULL);
+
+    printf("#cmd:%d|#dangerous_cmd_blocked:%d|last_cmd_time:%.5f|avg_time:%.5f|min_time:%.5f|max_time:%.5f|p50:%.5f|p95:%.5f|p99:%.5f|stddev:%.5f>>",
+           cmd, dangerous_cmd_blocked, last_cmd_time, avg_time, min_time, max_time, p50, p95, p99, stddev);
+}
+
+// Adds a finished command to the latency histograms, O(1) apart from expiring old window samples
+void latency_record(double runtime)
+{
+    sigset_t block, old;
+    sigemptyset(&block);
+    sigaddset(&block, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &block, &old);
+
+    latency_add(&all_latency, runtime, 1);
+
+    if (window_limit > 0 || window_seconds > 0)
+    {
+        double now = monotonic_seconds();
+        int capacity = window_limit > 0 ? window_limit : STATS_WINDOW_MAX;
+        if (window_count == capacity) // the oldest sample makes room
+        {
+            latency_add(&window_latency, window_samples[window_first].runtime, -1);
+            window_first = (window_first + 1) % STATS_WINDOW_MAX;
+            window_count--;
+        }
+
+        struct window_sample* sample = &window_samples[(window_first + window_count) % STATS_WINDOW_MAX];
+        sample->runtime = runtime;
+        sample->finished = now;
+        window_count++;
+        latency_add(&window_latency, runtime, 1);
+        window_expire(now);
+    }
+
+    sigprocmask(SIG_SETMASK, &old, NULL);
+}
+
+// Adds (sign 1) or removes (sign -1) one runtime
+void latency_add(struct latency_histogram* histogram, double runtime, int sign)
+{
+    histogram->buckets[ex3_hist_bucket((uint64_t)(runtime * 1e9))] += sign;
+    histogram->count += sign;
+    histogram->sum += sign * runtime;
+    histogram->sum_squares += sign * runtime * runtime;
+}
+
+// Runtime below which fraction of the commands finished, within 1%; capped at max when it is known (> 0)
+double latency_percentile(const struct latency_histogram* histogram, double fraction, double max)
+{
+    if (histogram->count == 0)
+        return 0;
+
+    unsigned long rank = (unsigned long)(fraction * histogram->count + 0.999999);
+    unsigned long seen = 0;
+    if (rank == 0)
+        rank = 1;
+
+    for (int i = 0; i < EX3_HIST_BUCKETS; i++)
+    {
+        seen += histogram->buckets[i];
+        if (seen >= rank)
+        {
+            double value = ex3_hist_value(i) / 1e9;
+            return max > 0 && value > max ? max : value;
+        }
+    }
+    return max;
+}
+
+double latency_stddev(const struct latency_histogram* histogram)
+{
+    if (histogram->count < 2)
+        return 0;
+
+    double mean = histogram->sum / histogram->count;
+    double variance = histogram->sum_squares / histogram->count - mean * mean;
+    return variance > 0 ? sqrt(variance) : 0;
+}
+
+// Drops window samples older than window_seconds
+void window_expire(double now)
+{
+    if (window_seconds <= 0)
+        return;
+
+    while (window_count > 0 && now - window_samples[window_first].finished > window_seconds)
+    {
+        latency_add(&window_latency, window_samples[window_first].runtime, -1);
+        window_first = (window_first + 1) % STATS_WINDOW_MAX;
+        window_count--;
+    }
+
+    if (window_count == 0) // clear the rounding left in the sums
+        memset(&window_latency, 0, sizeof(window_latency));
+}
+
+double monotonic_seconds(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+// N (last N commands), Ts (last T seconds) or off. The window starts empty.
+int set_stats_window(const char* arg)
+{
+    int limit = 0;
+    double seconds = 0;
+
+    if (strcmp(arg, "off") != 0)
+    {
+        char* end;
+        double value = strtod(arg, &end);
+        if (end == arg || value <= 0)
+            return -1;
+
+        if (strcmp(end, "s") == 0)
+            seconds = value;
+        else if (*end == '\0' && value == (int)value && value <= STATS_WINDOW_MAX)
+            limit = (int)value;
+        else
+            return -1;
+    }
+
+    sigset_t block, old;
+    sigemptyset(&block);
+    sigaddset(&block, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &block, &old);
+
+    window_limit = limit;
+    window_seconds = seconds;
+    window_first = 0;
+    window_count = 0;
+    memset(&window_latency, 0, sizeof(window_latency));
+
+    sigprocmask(SIG_SETMASK, &old, NULL);
+    return 0;
+}
+
+// stats : latency since the shell started and in the sliding window, then the STATS_TOP commands by total time
+// stats <name> : the stats of one command name
+// stats window N|Ts|off : keep a window of the last N commands or T seconds (at most STATS_WINDOW_MAX commands)
+void handle_stats(char* command[], int arg_count)
+{
+    struct timeval start, end;
+    gettimeofday(&start, NULL);
+
+    sigset_t block, old;
+    sigemptyset(&block);
+    sigaddset(&block, SIGCHLD);
+
+    if (arg_count == 3 && strcmp(command[1], "window") == 0)
+    {
+        if (set_stats_window(command[2]) == -1)
+        {
+            printf("ERR\n");
+            return;
+        }
+    }
+    else if (arg_count == 2)
+    {
+        sigprocmask(SIG_BLOCK, &block, &old);
+        struct command_stats* stats = command_stats_find(command[1], 0);
+        if (stats != NULL)
+            print_command_stats(stats);
+        sigprocmask(SIG_SETMASK, &old, NULL);
+
+        if (stats == NULL)
+        {
+            printf("ERR\n");
+            return;
+        }
+    }
+    else if (arg_count != 1)
+    {
+        printf("ERR\n");
+        return;
+    }
+    else
+    {
+        sigprocmask(SIG_BLOCK, &block, &old);
+
+        print_latency("all", &all_latency, max_time);
+        if (window_limit > 0 || window_seconds > 0)
+        {
+            char label[64];
+            window_expire(monotonic_seconds());
+            if (window_limit > 0)
+                snprintf(label, sizeof(label), "last %d commands", window_limit);
+            else
+                snprintf(label, sizeof(label), "last %gs", window_seconds);
+            print_latency(label, &window_latency, 0);
+        }
+
+        // pick the STATS_TOP largest totals, the table is small enough to scan once per pick
+        int top[STATS_TOP];
+        int top_count = 0;
+        for (; top_count < STATS_TOP && top_count < command_table_count; top_count++)
+        {
+            int best = -1;
+            for (int i = 0; i < command_table_count; i++)
+            {
+                int taken = 0;
+                for (int j = 0; j < top_count; j++)
+                    taken |= top[j] == i;
+                if (!taken && (best == -1 || command_table[i].total > command_table[best].total))
+                    best = i;
+            }
+            top[top_count] = best;
+        }
+
+        if (top_count > 0)
+            printf("%-20s %8s %7s %10s %10s %10s %10s %10s %10s\n", "command", "count", "failed", "total", "mean", "min", "p50", "p99", "max");
+        for (int i = 0; i < top_count; i++)
+        {
+            const struct command_stats* stats = &command_table[top[i]];
+            printf("%-20.20s %8lu %7lu %10.5f %10.5f %10.5f %10.5f %10.5f %10.5f\n", stats->name, stats->count, stats->failures,
+                   stats->total, stats->total / stats->count, stats->min,
+                   latency_percentile(&stats->latency, 0.50, stats->max), latency_percentile(&stats->latency, 0.99, stats->max), stats->max);
+        }
+
+        sigprocmask(SIG_SETMASK, &old, NULL);
+    }
+
+    gettimeofday(&end, NULL);
+    double runtime = (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1000000.0;
+    update_timing_stats(runtime, "stats");
+}
+
+void print_latency(const char* label, const struct latency_histogram* histogram, double max)
+{
+    printf("%s: count=%lu mean=%.5f stddev=%.5f p50=%.5f p90=%.5f p95=%.5f p99=%.5f p99.9=%.5f max=%.5f\n",
+           label, histogram->count, histogram->count ? histogram->sum / histogram->count : 0.0,
+           latency_stddev(histogram),
+           latency_percentile(histogram, 0.50, max), latency_percentile(histogram, 0.90, max),
+           latency_percentile(histogram, 0.95, max), latency_percentile(histogram, 0.99, max),
+           latency_percentile(histogram, 0.999, max), max > 0 ? max : latency_percentile(histogram, 1.0, 0));
+}
+
+// Adds a run to the stats of the command's name (its first word); a name not in the table takes
+// the entry of the least recently run one when the table is full
+void command_stats_record(const char* command_name, double runtime, int failed)
+{
+    sigset_t block, old;
+    sigemptyset(&block);
+    sigaddset(&block, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &block, &old);
+
+    command_stats_add(command_name, runtime, failed);
+
+    sigprocmask(SIG_SETMASK, &old, NULL);
+}
+
+// command_stats_record for a caller that has SIGCHLD blocked or no children yet
+void command_stats_add(const char* command_name, double runtime, int failed)
+{
+    char name[COMMAND_NAME_SIZE];
+    command_name += strspn(command_name, " ");
+    size_t len = strcspn(command_name, " ");
+    if (len == 0)
+        return;
+    if (len >= sizeof(name))
+        len = sizeof(name) - 1;
+    memcpy(name, command_name, len);
+    name[len] = '\0';
+
+    struct command_stats* stats = command_stats_find(name, 1);
+    stats->count++;
+    if (failed)
+        stats->failures++;
+    stats->total += runtime;
+    if (runtime < stats->min || stats->count == 1)
+        stats->min = runtime;
+    if (runtime > stats->max)
+        stats->max = runtime;
+    latency_add(&stats->latency, runtime, 1);
+}
+
+// The entry of name, moved to the front of the LRU list. With create a missing name gets a fresh
+// entry, otherwise NULL is returned. SIGCHLD must be blocked by the caller.
+struct command_stats* command_stats_find(const char* name, int create)
+{
+    uint64_t id = ex3_command_id(name);
+    int chain = id & (COMMAND_STATS_BUCKETS - 1);
+    int index;
+
+    for (index = command_chains[chain]; index != -1; index = command_table[index].hash_next)
+    {
+        if (command_table[index].id == id && strcmp(command_table[index].name, name) == 0)
+            break;
+    }
+
+    if (index == -1)
+    {
+        if (!create)
+            return NULL;
+
+        if (command_table_count < COMMAND_STATS_MAX)
+            index = command_table_count++;
+        else
+        {
+            index = command_oldest;
+            command_stats_unlink(index);
+
+            // take it off its hash chain as well
+            int* link = &command_chains[command_table[index].id & (COMMAND_STATS_BUCKETS - 1)];
+            while (*link != index)
+                link = &command_table[*link].hash_next;
+            *link = command_table[index].hash_next;
+        }
+
+        struct command_stats* stats = &command_table[index];
+        memset(stats, 0, sizeof(*stats));
+        snprintf(stats->name, sizeof(stats->name), "%s", name);
+        stats->id = id;
+        stats->hash_next = command_chains[chain];
+        command_chains[chain] = index;
+    }
+    else
+        command_stats_unlink(index);
+
+    // most recently used goes first
+    struct command_stats* stats = &command_table[index];
+    stats->newer = -1;
+    stats->older = command_newest;
+    if (command_newest != -1)
+        command_table[command_newest].newer = index;
+    command_newest = index;
+    if (command_oldest == -1)
+        command_oldest = index;
+
+    return stats;
+}
+
+// Takes an entry off the LRU list
+void command_stats_unlink(int index)
+{
+    struct command_stats* stats = &command_table[index];
+
+    if (stats->newer != -1)
+        command_table[stats->newer].older = stats->older;
+    else
+        command_newest = stats->older;
+
+    if (stats->older != -1)
+        command_table[stats->older].newer = stats->newer;
+    else
+        command_oldest = stats->newer;
+}
+
+void print_command_stats(const struct command_stats* stats)
+{
+    printf("%s: count=%lu failed=%lu total=%.5f mean=%.5f stddev=%.5f min=%.5f p50=%.5f p90=%.5f p95=%.5f p99=%.5f max=%.5f\n",
+           stats->name, stats->count, stats->failures, stats->total, stats->total / stats->count,
+           latency_stddev(&stats->latency), stats->min,
+           latency_percentile(&stats->latency, 0.50, stats->max), latency_percentile(&stats->latency, 0.90, stats->max),
+           latency_percentile(&stats->latency, 0.95, stats->max), latency_percentile(&stats->latency, 0.99, stats->max),
+           stats->max);
+}
+
+// Rebuilds the prompt and per-command statistics from exec_times at path: the checkpoint next to it
+// has everything up to some offset, only the records after it are parsed (mmap'ed, one pass), and the
+// checkpoint is moved to the end. If the file was rotated since, the checkpoint is continued in its
+// segment. Called at startup and again on exit to take in this session.
+int resume_stats(const char* path)
+{
+    uint64_t opened_us = realtime_us();
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd == -1 || fstat(fd, &st) == -1)
+    {
+        perror(path);
+        if (fd != -1)
+            close(fd);
+        return -1;
+    }
+
+    const char* data = NULL;
+    if (st.st_size > 0)
+    {
+        data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED)
+        {
+            perror("mmap");
+            close(fd);
+            return -1;
+        }
+        madvise((void*)data, st.st_size, MADV_SEQUENTIAL);
+    }
+    close(fd);
+
+    struct stats_checkpoint* checkpoint = malloc(sizeof(struct stats_checkpoint));
+    if (checkpoint == NULL)
+    {
+        perror("malloc");
+        if (data != NULL)
+            munmap((void*)data, st.st_size);
+        return -1;
+    }
+
+    char checkpoint_path[PATH_MAX];
+    snprintf(checkpoint_path, sizeof(checkpoint_path), "%s%s", path, STATS_CHECKPOINT_SUFFIX);
+
+    size_t offset = 0;
+    int loaded = load_stats_checkpoint(checkpoint_path, checkpoint) == 0;
+    if (loaded && stats_checkpoint_matches(checkpoint, data, &st))
+    {
+        restore_stats_checkpoint(checkpoint);
+        offset = checkpoint->offset;
+    }
+    else if (!loaded || (checkpoint->device == st.st_dev && checkpoint->inode == st.st_ino) ||
+             resume_stats_rotated(path, checkpoint) == -1)
+    {
+        // no checkpoint of this file or its segment: rebuild from every segment
+        reset_stats();
+        char** segments;
+        int segment_count = list_log_segments(path, &segments);
+        for (int i = 0; i < segment_count; i++)
+        {
+            resume_stats_segment(segments[i], 0, NULL, 0);
+            free(segments[i]);
+        }
+        if (segment_count > 0)
+            free(segments);
+    }
+
+    // complete lines only, a record being appended by another shell waits for next time
+    while (offset < (size_t)st.st_size)
+    {
+        const char* line = data + offset;
+        const char* newline = memchr(line, '\n', st.st_size - offset);
+        if (newline == NULL)
+            break;
+        resume_stats_line(line, newline - line);
+        offset = newline + 1 - data;
+    }
+
+    avg_time = cmd > 0 ? total_time / cmd : 0;
+    save_stats_checkpoint(checkpoint_path, data, offset, &st, opened_us, checkpoint);
+
+    free(checkpoint);
+    if (data != NULL)
+        munmap((void*)data, st.st_size);
+    return 0;
+}
+
+// The checkpoint's exec_times was rotated since. Its segment is the first one named after the
+// file was opened; the bytes before the checkpoint's offset have to match. The rest of that
+// segment and every later one are taken in, so only what was written since the checkpoint is read.
+// -1 if the segment is gone (--rotate-keep) or not the same file, the caller then rebuilds.
+int resume_stats_rotated(const char* path, const struct stats_checkpoint* checkpoint)
+{
+    char stamp[32];
+    struct timeval opened = { checkpoint->opened_us / 1000000, checkpoint->opened_us % 1000000 };
+    format_segment_stamp(&opened, stamp, sizeof(stamp));
+
+    const char* base = strrchr(path, '/');
+    size_t base_len = strlen(base != NULL ? base + 1 : path);
+
+    char** segments;
+    int count = list_log_segments(path, &segments);
+    int first = 0;
+    for (; first < count; first++)
+    {
+        const char* name = strrchr(segments[first], '/');
+        name = name != NULL ? name + 1 : segments[first];
+        if (strncmp(name + base_len + 1, stamp, strlen(stamp)) >= 0)
+            break;
+    }
+
+    int result = -1;
+    if (first < count)
+    {
+        restore_stats_checkpoint(checkpoint);
+        result = resume_stats_segment(segments[first], checkpoint->offset, checkpoint->tail, checkpoint->tail_length);
+        for (int i = first + 1; result == 0 && i < count; i++)
+            resume_stats_segment(segments[i], 0, NULL, 0);
+    }
+
+    for (int i = 0; i < count; i++)
+        free(segments[i]);
+    if (count > 0)
+        free(segments);
+    return result;
+}
+
+// Reads the checkpoint at path; -1 when there is none or it is of another version
+int load_stats_checkpoint(const char* path, struct stats_checkpoint* checkpoint)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd == -1)
+        return -1;
+
+    ssize_t got = read(fd, checkpoint, sizeof(*checkpoint));
+    close(fd);
+
+    if (got != sizeof(*checkpoint) || checkpoint->magic != STATS_CHECKPOINT_MAGIC || checkpoint->version != STATS_CHECKPOINT_VERSION ||
+        checkpoint->size != sizeof(*checkpoint) || checkpoint->tail_length > STATS_CHECKPOINT_TAIL ||
+        checkpoint->tail_length > checkpoint->offset)
+        return -1;
+    return 0;
+}
+
+// Whether the checkpoint belongs to the exec_times in data: not truncated, rotated or replaced since
+int stats_checkpoint_matches(const struct stats_checkpoint* checkpoint, const char* data, const struct stat* st)
+{
+    return checkpoint->offset <= (uint64_t)st->st_size && checkpoint->device == st->st_dev && checkpoint->inode == st->st_ino &&
+           memcmp(data + checkpoint->offset - checkpoint->tail_length, checkpoint->tail, checkpoint->tail_length) == 0;
+}
+
+void restore_stats_checkpoint(const struct stats_checkpoint* checkpoint)
+{
+    cmd = checkpoint->cmd;
+    total_time = checkpoint->total_time;
+    min_time = checkpoint->min_time;
+    max_time = checkpoint->max_time;
+    all_latency = checkpoint->all_latency;
+    command_table_count = checkpoint->command_table_count;
+    command_newest = checkpoint->command_newest;
+    command_oldest = checkpoint->command_oldest;
+    memcpy(command_chains, checkpoint->command_chains, sizeof(command_chains));
+    memcpy(command_table, checkpoint->command_table, sizeof(command_table));
+}
+
+void reset_stats(void)
+{
+    cmd = 0;
+    total_time = min_time = max_time = 0;
+    memset(&all_latency, 0, sizeof(all_latency));
+    command_table_count = 0;
+    command_newest = command_oldest = -1;
+    memset(command_chains, -1, sizeof(command_chains));
+}
+
+// Writes the current statistics as the checkpoint of the first offset bytes of data.
+// Written to a temporary file and renamed, so a shell starting meanwhile sees the old or the new one.
+void save_stats_checkpoint(const char* path, const char* data, size_t offset, const struct stat* st, uint64_t opened_us, struct stats_checkpoint* checkpoint)
+{
+    memset(checkpoint, 0, sizeof(*checkpoint));
+    checkpoint->magic = STATS_CHECKPOINT_MAGIC;
+    checkpoint->version = STATS_CHECKPOINT_VERSION;
+    checkpoint->size = sizeof(*checkpoint);
+    checkpoint->offset = offset;
+    checkpoint->device = st->st_dev;
+    checkpoint->inode = st->st_ino;
+    checkpoint->opened_us = opened_us;
+    checkpoint->tail_length = offset < STATS_CHECKPOINT_TAIL ? offset : STATS_CHECKPOINT_TAIL;
+    if (checkpoint->tail_length > 0)
+        memcpy(checkpoint->tail, data + offset - checkpoint->tail_length, checkpoint->tail_length);
+    checkpoint->cmd = cmd;
+    checkpoint->total_time = total_time;
+    checkpoint->min_time = min_time;
+    checkpoint->max_time = max_time;
+    checkpoint->all_latency = all_latency;
+    checkpoint->command_table_count = command_table_count;
+    checkpoint->command_newest = command_newest;
+    checkpoint->command_oldest = command_oldest;
+    memcpy(checkpoint->command_chains, command_chains, sizeof(command_chains));
+    memcpy(checkpoint->command_table, command_table, sizeof(command_table));
+
+    char temp_path[PATH_MAX];
+    snprintf(temp_path, sizeof(temp_path), "%s.%d", path, (int)getpid());
+    int fd = open(temp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd == -1)
+    {
+        perror(temp_path);
+        return;
+    }
+
+    if (write_all(fd, (const char*)checkpoint, sizeof(*checkpoint)) == -1 || close(fd) == -1 || rename(temp_path, path) == -1)
+    {
+        perror(path);
+        unlink(temp_path);
+    }
+}
+
+// One exec_times record back into the statistics, the way the shell counted it when it wrote it:
+// "<command> : <sec> sec[ (<detail>)]" went into the prompt and its command name,
+// "<command> : failed <sec> sec (<detail>)" only into its command name. Pipeline and fan-out totals
+// never counted, and background failures carry no time; both are skipped. " [pid N, seq N]" is ignored.
+void resume_stats_line(const char* line, size_t len)
+{
+    const char* end = line + len;
+    const char* separator = line;
+    const char* value = NULL;
+    int failed = 0;
+
+    // the first " : " followed by a time, a command may contain " : " itself
+    while ((separator = memmem(separator, end - separator, " : ", 3)) != NULL)
+    {
+        value = separator + 3;
+        failed = end - value > 7 && memcmp(value, "failed ", 7) == 0;
+        if (failed)
+            value += 7;
+        if (value < end && isdigit((unsigned char)*value))
+            break;
+        separator++;
+    }
+    if (separator == NULL)
+        return;
+
+    // "%.5f" by hand, strtod is most of the parsing time on a large log
+    const char* after = value;
+    double runtime = 0;
+    while (after < end && isdigit((unsigned char)*after))
+        runtime = runtime * 10 + (*after++ - '0');
+    if (after < end && *after == '.')
+    {
+        double scale = 1;
+        for (after++; after < end && isdigit((unsigned char)*after); after++)
+        {
+            scale /= 10;
+            runtime += (*after - '0') * scale;
+        }
+    }
+    if (end - after < 4 || memcmp(after, " sec", 4) != 0)
+        return;
+    after += 4;
+    if (!failed && end - after >= 12 && (memcmp(after, " (pipeline, ", 12) == 0 || memcmp(after, " (fan-out, ", 11) == 0))
+        return;
+
+    char name[COMMAND_NAME_SIZE];
+    size_t name_len = separator - line;
+    if (name_len >= sizeof(name))
+        name_len = sizeof(name) - 1; // command_stats_add only keeps the first word
+    memcpy(name, line, name_len);
+    name[name_len] = '\0';
+
+    if (!failed)
+    {
+        cmd++;
+        total_time += runtime;
+        if (runtime > max_time)
+            max_time = runtime;
+        if (runtime < min_time || min_time == 0)
+            min_time = runtime;
+        latency_add(&all_latency, runtime, 1);
+    }
+    command_stats_add(name, runtime, failed);
+}
+
+// Parses a rotated exec_times segment, gzip'ed or not (gzread passes plain files through), from
+// skip on. The tail_length bytes before skip have to be tail, else -1 before anything is taken in.
+int resume_stats_segment(const char* path, uint64_t skip, const char* tail, size_t tail_length)
+{
+    gzFile file = gzopen(path, "rb");
+    if (file == NULL)
+    {
+        perror(path);
+        return -1;
+    }
+    gzbuffer(file, 256 * 1024);
+
+    if (skip > 0)
+    {
+        char before[STATS_CHECKPOINT_TAIL];
+        if (gzseek(file, skip - tail_length, SEEK_SET) == -1 || gzread(file, before, tail_length) != (int)tail_length ||
+            memcmp(before, tail, tail_length) != 0)
+        {
+            gzclose(file);
+            return -1;
+        }
+    }
+
+    static char buffer[1024 * 1024]; // only the main thread resumes
+    size_t used = 0;
+    int got;
+    while ((got = gzread(file, buffer + used, sizeof(buffer) - used)) > 0)
+    {
+        used += got;
+        char* line = buffer;
+        char* newline;
+        while ((newline = memchr(line, '\n', buffer + used - line)) != NULL)
+        {
+            resume_stats_line(line, newline - line);
+            line = newline + 1;
+        }
+
+        used = buffer + used - line;
+        if (used == sizeof(buffer))
+            used = 0; // a line of a megabyte is not a record
+        memmove(buffer, line, used);
+    }
+
+    if (got < 0)
+        fprintf(stderr, "%s: %s\n", path, gzerror(file, &got));
+    gzclose(file);
+    return 0;
+}
+
+// The rotated segments of the exec_times at path (<path>.<yyyymmdd-hhmmss.usec>[.gz]), oldest first.
+// Returns how many, *segments and each name are malloc'ed.
+int list_log_segments(const char* path, char*** segments)
+{
+    char directory[PATH_MAX];
+    const char* base = strrchr(path, '/');
+    if (base != NULL)
+    {
+        snprintf(directory, sizeof(directory), "%.*s", (int)(base - path) + 1, path);
+        base++;
+    }
+    else
+    {
+        strcpy(directory, ".");
+        base = path;
+    }
+
+    DIR* dir = opendir(directory);
+    if (dir == NULL)
+        return 0;
+
+    int count = 0, capacity = 0;
+    size_t base_len = strlen(base);
+    struct dirent* entry;
+    *segments = NULL;
+    while ((entry = readdir(dir)) != NULL)
+    {
+        const char* suffix = entry->d_name + base_len;
+        size_t name_len = strlen(entry->d_name);
+        if (strncmp(entry->d_name, base, base_len) != 0 || suffix[0] != '.' || !isdigit((unsigned char)suffix[1]) ||
+            (name_len > 4 && strcmp(entry->d_name + name_len - 4, ".tmp") == 0))
+            continue; // also skips .stats and a compression in progress
+
+        if (count == capacity)
+        {
+            capacity = capacity ? capacity * 2 : 16;
+            char** bigger = realloc(*segments, capacity * sizeof(char*));
+            if (bigger == NULL)
+                break;
+            *segments = bigger;
+        }
+
+        char full[PATH_MAX + 256];
+        snprintf(full, sizeof(full), "%s%s%s", directory, base == path ? "/" : "", entry->d_name);
+        (*segments)[count++] = strdup(full);
+    }
+    closedir(dir);
+
+    qsort(*segments, count, sizeof(char*), compare_segments);
+
+    // a segment being compressed shows up twice for a moment, its finished .gz is the one to use
+    int kept = 0;
+    for (int i = 0; i < count; i++)
+    {
+        size_t len = strlen((*segments)[i]);
+        if (i + 1 < count && strncmp((*segments)[i], (*segments)[i + 1], len) == 0 && strcmp((*segments)[i + 1] + len, ".gz") == 0)
+        {
+            free((*segments)[i]);
+            continue;
+        }
+        (*segments)[kept++] = (*segments)[i];
+    }
+    return kept;
+}
+
+// Segment names hold a fixed-width UTC time, so they sort by name (a .gz right after its plain segment)
+int compare_segments(const void* a, const void* b)
+{
+    return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+// Called by the logger before writing: follows a rotation another shell made, and rotates
+// when the segment reached --rotate-size or --rotate-age
+void log_check_rotation(void)
+{
+    if (rotate_size == 0 && rotate_age == 0)
+        return;
+
+    struct stat current, ours;
+    if (fstat(log_fd, &ours) == -1)
+        return;
+    if (stat(log_path, &current) == -1 || current.st_ino != ours.st_ino || current.st_dev != ours.st_dev)
+    {
+        log_reopen();
+        return;
+    }
+
+    if ((rotate_size > 0 && (unsigned long long)ours.st_size >= rotate_size) ||
+        (rotate_age > 0 && time(NULL) - log_segment_start >= rotate_age))
+        log_rotate();
+}
+
+// Renames exec_times to <path>.<UTC time>, continues in a new file and compresses the old one in
+// the background. flock keeps shells sharing the file from rotating it twice.
+void log_rotate(void)
+{
+    struct stat current, ours;
+    flock(log_fd, LOCK_EX);
+    if (fstat(log_fd, &ours) == -1 || stat(log_path, &current) == -1 ||
+        current.st_ino != ours.st_ino || current.st_dev != ours.st_dev)
+    {
+        flock(log_fd, LOCK_UN);
+        log_reopen(); // rotated by another shell while we waited
+        return;
+    }
+
+    struct timeval now;
+    char stamp[32], segment[PATH_MAX + 64];
+    gettimeofday(&now, NULL);
+    format_segment_stamp(&now, stamp, sizeof(stamp));
+    snprintf(segment, sizeof(segment), "%s.%s", log_path, stamp);
+
+    binlog_rotate(stamp); // first, shells that see the new exec_times find the new binlog too
+    if (rename(log_path, segment) == -1)
+    {
+        perror(segment);
+        flock(log_fd, LOCK_UN);
+        return;
+    }
+    log_reopen(); // closing the old description releases the lock
+
+    // a running compressor picks the segment up before it ends, otherwise start one
+    atomic_store(&compress_pending, 1);
+    int idle = 0;
+    if (atomic_compare_exchange_strong(&compress_active, &idle, 1))
+    {
+        if (compress_started)
+            pthread_join(compress_thread, NULL); // it has finished already
+        compress_started = pthread_create(&compress_thread, NULL, compress_segments, NULL) == 0;
+        if (!compress_started)
+            atomic_store(&compress_active, 0); // the segment stays plain until the next rotation
+    }
+}
+
+// The suffix of a segment rotated at when, <yyyymmdd-hhmmss.usec> in UTC: names sort by time
+void format_segment_stamp(const struct timeval* when, char* stamp, size_t size)
+{
+    struct tm utc;
+    char seconds[16];
+    gmtime_r(&when->tv_sec, &utc);
+    strftime(seconds, sizeof(seconds), "%Y%m%d-%H%M%S", &utc);
+    snprintf(stamp, size, "%s.%06ld", seconds, (long)when->tv_usec);
+}
+
+// Points log_fd at the file now at log_path (creating it), keeping the fd number the shell's
+// FILE* exec_times uses, and binlog_fd at the binary log rotated with it
+void log_reopen(void)
+{
+    binlog_reopen();
+
+    int fd = open(log_path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (fd == -1)
+    {
+        perror(log_path);
+        return;
+    }
+    dup2(fd, log_fd);
+    close(fd);
+    fcntl(log_fd, F_SETFD, FD_CLOEXEC); // dup2 clears it
+    log_segment_start = log_segment_birth(log_fd);
+}
+
+// When the segment was created, so --rotate-age holds across restarts. Falls back to now on
+// file systems without a birth time.
+time_t log_segment_birth(int fd)
+{
+#ifdef STATX_BTIME
+    struct statx stx;
+    if (statx(fd, "", AT_EMPTY_PATH, STATX_BTIME, &stx) == 0 && (stx.stx_mask & STATX_BTIME))
+        return stx.stx_btime.tv_sec;
+#endif
+    return time(NULL);
+}
+
+// Thread body: gzips every plain rotated segment (those of other shells and of earlier runs too) and
+// removes the oldest segments beyond rotate_keep, until no rotation happened meanwhile
+void* compress_segments(void* arg)
+{
+    while (1)
+    {
+        atomic_store(&compress_pending, 0);
+
+        // shells sharing the file write to the old segment until their next check
+        struct timespec grace = { ROTATE_GRACE_MS / 1000, (ROTATE_GRACE_MS % 1000) * 1000000L };
+        nanosleep(&grace, NULL);
+
+        char** segments;
+        int count = list_log_segments(log_path, &segments);
+        for (int i = 0; i < count; i++)
+        {
+            size_t len = strlen(segments[i]);
+            if (len < 3 || strcmp(segments[i] + len - 3, ".gz") != 0)
+                compress_segment(segments[i]);
+        }
+        for (int i = 0; i < count; i++)
+            free(segments[i]);
+        if (count > 0)
+            free(segments);
+
+        remove_old_segments(log_path);
+        if (binlog_fd != -1)
+            remove_old_segments(binlog_path); // left plain, ex3-stats mmaps them
+
+        atomic_store(&compress_active, 0);
+        int idle = 0;
+        if (!atomic_load(&compress_pending) || !atomic_compare_exchange_strong(&compress_active, &idle, 1))
+            return NULL; // nothing new, or the logger started the next compressor
+    }
+}
+
+// Unlinks all but the newest rotate_keep segments of the log at path
+void remove_old_segments(const char* path)
+{
+    char** segments;
+    int count = list_log_segments(path, &segments);
+    for (int i = 0; i < count; i++)
+    {
+        if (i < count - rotate_keep)
+            unlink(segments[i]);
+        free(segments[i]);
+    }
+    if (count > 0)
+        free(segments);
+}
+
+// Replaces segment with <segment>.gz. Another shell's compressor may get there first, then this is a no-op.
+int compress_segment(const char* segment)
+{
+    char temp[PATH_MAX + 64], done[PATH_MAX + 64];
+    snprintf(done, sizeof(done), "%s.gz", segment);
+    snprintf(temp, sizeof(temp), "%s.gz.%d.tmp", segment, (int)getpid());
+
+    int in = open(segment, O_RDONLY | O_CLOEXEC);
+    if (in == -1)
+        return errno == ENOENT ? 0 : -1;
+
+    gzFile out = gzopen(temp, "wb");
+    int failed = out == NULL;
+    if (!failed)
+    {
+        static char buffer[LOG_BATCH_SIZE]; // only the compressor thread gets here
+        ssize_t got;
+        while ((got = read(in, buffer, sizeof(buffer))) > 0)
+        {
+            if (gzwrite(out, buffer, got) != got)
+            {
+                failed = 1;
+                break;
+            }
+        }
+        failed |= got < 0;
+        if (gzclose(out) != Z_OK)
+            failed = 1;
+    }
+    close(in);
+
+    if (failed || rename(temp, done) == -1)
+    {
+        perror(segment); // the plain segment is kept, readers take it as it is
+        unlink(temp);
+        return -1;
+    }
+    unlink(segment);
+    return 0;
+}
+
+// Creates and maps /dev/shm/ex3-<pid>. Without shared memory the shell runs as before, unpublished.
+void shm_open_stats(void)
+{
+    char name[64];
+    snprintf(name, sizeof(name), "/%s%d", EX3_SHM_PREFIX, (int)getpid());
+
+    int fd = shm_open(name, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd == -1)
+        return;
+    if (ftruncate(fd, sizeof(struct ex3_shm_stats)) == -1)
+    {
+        close(fd);
+        shm_unlink(name);
+        return;
+    }
+
+    void* mapped = mmap(NULL, sizeof(struct ex3_shm_stats), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mapped == MAP_FAILED)
+    {
+        shm_unlink(name);
+        return;
+    }
+
+    shm_stats = mapped; // zero filled by ftruncate, so seq starts even
+    shm_begin();
+    shm_stats->magic = EX3_SHM_MAGIC;
+    shm_stats->version = EX3_SHM_VERSION;
+    shm_stats->size = sizeof(struct ex3_shm_stats);
+    shm_stats->pid = getpid();
+    shm_stats->started_us = realtime_us();
+    shm_end();
+
+    shm_owner = getpid();
+    atexit(shm_close_stats);
+}
+
+void shm_close_stats(void)
+{
+    if (shm_stats == NULL || shm_owner != getpid())
+        return;
+
+    shm_unlink_stats();
+    munmap(shm_stats, sizeof(struct ex3_shm_stats));
+    shm_stats = NULL;
+}
+
+// Removes the name only, the mapping stays valid for a main thread still publishing into it
+void shm_unlink_stats(void)
+{
+    if (shm_stats == NULL || shm_owner != getpid())
+        return;
+
+    char name[64];
+    snprintf(name, sizeof(name), "/%s%d", EX3_SHM_PREFIX, (int)getpid());
+    shm_unlink(name);
+}
+
+// seq odd: readers retry until the matching shm_end
+void shm_begin(void)
+{
+    shm_writing = 1;
+    uint64_t seq = atomic_load_explicit(&shm_stats->seq, memory_order_relaxed);
+    atomic_store_explicit(&shm_stats->seq, seq + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release); // seq is odd before any field changes
+}
+
+void shm_end(void)
+{
+    uint64_t seq = atomic_load_explicit(&shm_stats->seq, memory_order_relaxed);
+    atomic_store_explicit(&shm_stats->seq, seq + 1, memory_order_release);
+    shm_writing = 0;
+}
+
+// Everything the prompt shows, the background jobs, and no current command. SIGCHLD is blocked by print_prompt.
+void shm_publish_prompt(double p50, double p95, double p99)
+{
+    if (shm_stats == NULL || shm_writing)
+        return;
+
+    shm_begin();
+    shm_stats->cmd = cmd;
+    shm_stats->dangerous_cmd_blocked = dangerous_cmd_blocked;
+    shm_stats->dangerous_cmd_warning = dangerous_cmd_warning;
+    shm_stats->last_cmd_time = last_cmd_time;
+    shm_stats->avg_time = avg_time;
+    shm_stats->min_time = min_time;
+    shm_stats->max_time = max_time;
+    shm_stats->p50 = p50;
+    shm_stats->p95 = p95;
+    shm_stats->p99 = p99;
+    shm_stats->command_start_us = 0;
+    shm_stats->command[0] = '\0';
+
+    shm_stats->bg_count = bg_count;
+    for (int i = 0; i < bg_count && i < EX3_SHM_MAX_JOBS; i++)
+    {
+        struct ex3_shm_job* job = &shm_stats->jobs[i];
+        job->pid = bg_processes[i].pid;
+        job->start_us = bg_processes[i].start_time.tv_sec * 1000000ULL + bg_processes[i].start_time.tv_usec;
+        snprintf(job->command, sizeof(job->command), "%.*s", (int)sizeof(job->command) - 1, bg_processes[i].command);
+    }
+    shm_stats->updated_us = realtime_us();
+    shm_end();
+}
+
+// The line the shell is about to run
+void shm_publish_command(const char* input)
+{
+    if (shm_stats == NULL)
+        return;
+
+    shm_begin();
+    shm_stats->command_start_us = realtime_us();
+    snprintf(shm_stats->command, sizeof(shm_stats->command), "%.*s", (int)sizeof(shm_stats->command) - 1, input);
+    shm_stats->updated_us = shm_stats->command_start_us;
+    shm_end();
+}
+
+// gettimeofday is served from the vDSO, no system call
+uint64_t realtime_us(void)
+{
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    return now.tv_sec * 1000000ULL + now.tv_usec;
+}
+
+void profile_start(void)
+{
+    profile_previous = monotonic_seconds();
+    profile_last_phase = -1;
+}
+
+// Ends phase: keeps the time since the previous point if it directly follows the last phase,
+// and counts the whole turn when it ends with the last phase. A skipped phase (a builtin, a
+// background job) drops the turn.
+void profile_point(int phase)
+{
+    double now = monotonic_seconds();
+    if (phase == profile_last_phase + 1)
+    {
+        profile_turn[phase] = now - profile_previous;
+        profile_last_phase = phase;
+        if (phase == PROFILE_PHASES - 1)
+        {
+            for (int i = 0; i < PROFILE_PHASES; i++)
+                latency_add(&profile_phases[i], profile_turn[i], 1);
+        }
+    }
+    else
+        profile_last_phase = PROFILE_PHASES;
+    profile_previous = now;
+}
+
+// profile on|off : time each phase of the REPL for external foreground commands
+// profile show : per phase count, mean, p50, p99, max and the shell's own share
+// profile reset : start over
+void handle_profile(char* command[], int arg_count)
+{
+    struct timeval start, end;
+    gettimeofday(&start, NULL);
+
+    if (arg_count != 2)
+    {
+        printf("ERR\n");
+        return;
+    }
+
+    if (strcmp(command[1], "on") == 0)
+    {
+        profile_enabled = 1;
+        profile_last_phase = PROFILE_PHASES; // this turn started unprofiled
+    }
+    else if (strcmp(command[1], "off") == 0)
+        profile_enabled = 0;
+    else if (strcmp(command[1], "reset") == 0)
+        memset(profile_phases, 0, sizeof(profile_phases));
+    else if (strcmp(command[1], "show") == 0)
+    {
+        double shell = 0, child = 0;
+
+        printf("%-12s %8s %10s %10s %10s %10s\n", "phase", "count", "mean us", "p50 us", "p99 us", "max us");
+        for (int i = 0; i < PROFILE_PHASES; i++)
+        {
+            const struct latency_histogram* phase = &profile_phases[i];
+            double mean = phase->count ? phase->sum / phase->count : 0;
+            printf("%-12s %8lu %10.1f %10.1f %10.1f %10.1f\n", profile_names[i], phase->count, mean * 1e6,
+                   latency_percentile(phase, 0.50, 0) * 1e6, latency_percentile(phase, 0.99, 0) * 1e6,
+                   latency_percentile(phase, 1.0, 0) * 1e6);
+
+            // waiting for input is neither the shell's work nor the command's
+            if (i == PROFILE_RUN)
+                child += mean;
+            else if (i != PROFILE_READ)
+                shell += mean;
+        }
+
+        if (shell + child > 0)
+            printf("shell %.1f us and child %.1f us per command, shell %.1f%%\n", shell * 1e6, child * 1e6, 100 * shell / (shell + child));
+    }
+    else
+    {
+        printf("ERR\n");
+        return;
+    }
+
+    gettimeofday(&end, NULL);
+    double runtime = (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1000000.0;
+    update_timing_stats(runtime, "profile");
+}
+
+// Picks the events of --perf-counters: the hardware ones if this kernel and machine count them for
+// us, else the software ones. Counting kernel time needs perf_event_paranoid < 2 (or CAP_PERFMON),
+// without it only user space is counted.
+void perf_probe(void)
+{
+    const struct perf_counter* sets[2] = { perf_hardware, perf_software };
+    int error = 0;
+
+    for (int set = 0; set < 2; set++)
+    {
+        for (perf_user_only = 0; perf_user_only <= 1; perf_user_only++)
+        {
+            int fd = perf_event_open(sets[set][0].type, sets[set][0].config, 0);
+            if (fd != -1)
+            {
+                close(fd);
+                perf_events = sets[set];
+                perf_enabled = 1;
+                if (set == 1)
+                    fprintf(stderr, "WARNING: hardware counters unavailable (%s), counting software events\n", strerror(error));
+                return;
+            }
+            if (set == 0)
+                error = errno;
+            if (errno != EACCES && errno != EPERM)
+                break; // not a permission problem, user space only will not help
+        }
+    }
+
+    fprintf(stderr, "WARNING: perf_event_open: %s, --perf-counters ignored\n", strerror(errno));
+}
+
+// A counter of one event for pid and every process it starts from then on. It starts disabled and
+// is enabled by the kernel at pid's next exec, so the shell's own work in the child is left out.
+int perf_event_open(uint32_t type, uint64_t config, pid_t pid)
+{
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = type;
+    attr.config = config;
+    attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+    attr.disabled = 1;
+    attr.enable_on_exec = 1;
+    attr.inherit = 1;
+    attr.exclude_kernel = perf_user_only;
+    attr.exclude_hv = perf_user_only;
+
+    return syscall(SYS_perf_event_open, &attr, pid, -1, -1, PERF_FLAG_FD_CLOEXEC);
+}
+
+// The child waits at the gate until its counters are attached, else a short command could exec
+// and exit before perf_attach gets to it. With a gate of -1s nobody waits.
+int perf_gate_open(int gate[2])
+{
+    return pipe2(gate, O_CLOEXEC);
+}
+
+void perf_gate_wait(int gate[2])
+{
+    if (gate[0] == -1)
+        return;
+
+    char byte;
+    close(gate[1]);
+    while (read(gate[0], &byte, 1) == -1 && errno == EINTR)
+        ;
+    close(gate[0]);
+}
+
+// Attaches the counters to the child waiting at the gate and lets it go. fds gets -1 for every
+// event that could not be counted.
+void perf_attach(pid_t pid, int gate[2], int fds[])
+{
+    for (int i = 0; i < PERF_EVENTS; i++)
+        fds[i] = -1;
+    if (gate[0] == -1)
+        return;
+
+    for (int i = 0; i < PERF_EVENTS; i++)
+        fds[i] = perf_event_open(perf_events[i].type, perf_events[i].config, pid);
+
+    close(gate[0]);
+    close(gate[1]); // end of file releases the child
+}
+
+void perf_close(int fds[])
+{
+    for (int i = 0; i < PERF_EVENTS; i++)
+    {
+        if (fds[i] != -1)
+            close(fds[i]);
+        fds[i] = -1;
+    }
+}
+
+// Reads and closes the counters of a reaped command into detail, "" if none were counted.
+// Counts of processes it left running are still missing. Only read(2) and close(2) on the
+// descriptors, handle_sigchild uses it too.
+void perf_read(int fds[], char* detail, size_t size)
+{
+    unsigned long long values[PERF_EVENTS];
+    size_t len = 0;
+
+    detail[0] = '\0';
+    for (int i = 0; i < PERF_EVENTS; i++)
+    {
+        uint64_t data[3]; // value, time enabled, time running
+        if (fds[i] == -1 || read(fds[i], data, sizeof(data)) != sizeof(data))
+        {
+            values[i] = 0;
+            continue;
+        }
+
+        // the kernel multiplexes when there are more events than counters, scale to the whole run
+        values[i] = data[2] > 0 && data[2] < data[1] ? (unsigned long long)((double)data[0] * data[1] / data[2]) : data[0];
+
+        if (len < size && perf_events[i].config == PERF_COUNT_SW_TASK_CLOCK && perf_events[i].type == PERF_TYPE_SOFTWARE)
+            len += snprintf(detail + len, size - len, "%s%s %.3f ms", len ? ", " : "", perf_events[i].name, values[i] / 1e6);
+        else if (len < size)
+            len += snprintf(detail + len, size - len, "%s%s %llu", len ? ", " : "", perf_events[i].name, values[i]);
+    }
+
+    // instructions per cycle, the first thing to look at when a command got slower
+    if (len < size && perf_events == perf_hardware && fds[0] != -1 && fds[1] != -1 && values[0] > 0)
+        snprintf(detail + len, size - len, ", IPC %.2f", (double)values[1] / values[0]);
+
+    perf_close(fds);
+}
+
+// Starts the trace file: a JSON array of trace events, closed by trace_close on exit.
+// chrome://tracing and ui.perfetto.dev also load a file cut short without the closing bracket.
+void trace_open(const char* path)
+{
+    trace_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (trace_fd == -1)
+    {
+        perror(path);
+        exit(1);
+    }
+    trace_owner = getpid();
+
+    char header[128];
+    int len = snprintf(header, sizeof(header), "[\n{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"args\":{\"name\":\"ex3\"}}",
+                       (int)getpid());
+    write_all(trace_fd, header, len);
+    atexit(trace_close);
+}
+
+void trace_close(void)
+{
+    if (trace_fd == -1 || trace_owner != getpid())
+        return;
+
+    pthread_mutex_lock(&trace_lock);
+    write_all(trace_fd, "\n]\n", 3);
+    close(trace_fd);
+    trace_fd = -1;
+    pthread_mutex_unlock(&trace_lock);
+}
+
+// One complete ("X") event on lane tid of the shell's process; args is the inside of a JSON
+// object or NULL. A child's lane is its pid and is named after the command the first time.
+void trace_span(const char* category, const char* name, int tid, uint64_t start_us, uint64_t end_us, const char* args)
+{
+    if (trace_fd == -1 || trace_owner != getpid())
+        return;
+
+    char escaped[MAX_SIZE * 2];
+    char event[MAX_SIZE * 5];
+    json_escape(escaped, sizeof(escaped), name);
+
+    int len = 0;
+    pid_t pid = getpid();
+    if (tid != pid && (strcmp(category, "command") == 0 || strcmp(category, "background") == 0 || strcmp(category, "stage") == 0))
+        len += snprintf(event + len, sizeof(event) - len, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+                        (int)pid, tid, escaped);
+    len += snprintf(event + len, sizeof(event) - len,
+                    ",\n{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%llu,\"dur\":%llu,\"pid\":%d,\"tid\":%d,\"args\":{%s}}",
+                    escaped, category, (unsigned long long)start_us,
+                    (unsigned long long)(end_us > start_us ? end_us - start_us : 0), (int)pid, tid, args != NULL ? args : "");
+    if (len >= (int)sizeof(event))
+        return;
+
+    // handle_sigchild traces too, it must not find the lock taken by the thread it interrupted
+    sigset_t block, old;
+    sigemptyset(&block);
+    sigaddset(&block, SIGCHLD);
+    pthread_sigmask(SIG_BLOCK, &block, &old);
+    pthread_mutex_lock(&trace_lock);
+    if (trace_fd != -1)
+        write_all(trace_fd, event, len);
+    pthread_mutex_unlock(&trace_lock);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+// A span per pipeline or fan-out stage on its own lane (the child's pid or the builtin stage's thread)
+void trace_stages(char stage_input[][MAX_SIZE], int count, const pid_t lane[], struct timeval stage_start[], struct timeval stage_end[])
+{
+    for (int i = 0; i < count; i++)
+    {
+        char args[32];
+        snprintf(args, sizeof(args), "\"stage\":%d", i + 1);
+        trace_span("stage", stage_input[i], lane[i], timeval_us(&stage_start[i]), timeval_us(&stage_end[i]), args);
+    }
+}
+
+// Copies in as the inside of a JSON string, cut to fit size
+void json_escape(char* out, size_t size, const char* in)
+{
+    size_t used = 0;
+    for (const unsigned char* p = (const unsigned char*)in; *p != '\0' && used + 7 < size; p++)
+    {
+        if (*p == '"' || *p == '\\')
+        {
+            out[used++] = '\\';
+            out[used++] = *p;
+        }
+        else if (*p < 0x20)
+            used += snprintf(out + used, size - used, "\\u%04x", *p);
+        else
+            out[used++] = *p;
+    }
+    out[used] = '\0';
+}
+
+uint64_t timeval_us(const struct timeval* tv)
+{
+    return tv->tv_sec * 1000000ULL + tv->tv_usec;
+}
+
+// Starts the logger thread writing exec_times records to fd (opened for appending).
+// The thread blocks every signal. Every thread the shell starts must at least block SIGCHLD
+// (builtin stages and mcalc workers do), so handle_sigchild only ever runs on the main thread.
+void log_start(int fd)
+{
+    // every record reaches the file in one O_APPEND write(2), so shells sharing the file never
+    // tear or interleave each other's lines; children have no business with the fd
+    log_fd = fd;
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_APPEND);
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    log_segment_start = log_segment_birth(fd);
+    if (pipe2(log_wake_fds, O_NONBLOCK | O_CLOEXEC) == -1)
+    {
+        perror("pipe");
+        exit(1);
+    }
+
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    if (pthread_create(&log_thread, NULL, log_thread_main, NULL) != 0)
+    {
+        perror("pthread_create");
+        exit(1);
+    }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+    log_owner = getpid();
+    atexit(log_shutdown); // also covers the exit(1) paths
+}
+
+// Queues one exec_times record (format ends with a newline). If the logger is LOG_RING_SIZE
+// records behind, the main thread waits up to LOG_FULL_WAIT_MS for room; inside handle_sigchild
+// it does not wait. A record that still finds no room is dropped and counted.
+void log_record(const char* format, ...)
+{
+    if (log_owner == 0)
+        return;
+
+    // handle_sigchild also logs, it must not interrupt a push half way
+    sigset_t block, old;
+    sigemptyset(&block);
+    sigaddset(&block, SIGCHLD);
+    pthread_sigmask(SIG_BLOCK, &block, &old);
+
+    unsigned long head = atomic_load_explicit(&log_head, memory_order_relaxed);
+    unsigned long tail;
+    log_seq++; // a dropped record leaves a gap in the sequence
+
+    if (log_wait_for_room(&log_tail, head, &tail, !in_sigchild) == -1)
+    {
+        atomic_fetch_add(&log_dropped, 1);
+        log_wake();
+    }
+    else
+    {
+        char* slot = log_ring[head & (LOG_RING_SIZE - 1)];
+        va_list args;
+        va_start(args, format);
+        int len = vsnprintf(slot, LOG_RECORD_SIZE, format, args);
+        va_end(args);
+
+        if (len < LOG_RECORD_SIZE && (log_field_pid || log_field_seq))
+        {
+            // the fields go at the end so "command : time" parsers keep working
+            char fields[64];
+            if (log_field_pid && log_field_seq)
+                snprintf(fields, sizeof(fields), " [pid %d, seq %lu]\n", (int)getpid(), log_seq);
+            else if (log_field_pid)
+                snprintf(fields, sizeof(fields), " [pid %d]\n", (int)getpid());
+            else
+                snprintf(fields, sizeof(fields), " [seq %lu]\n", log_seq);
+
+            if (len > 0 && slot[len - 1] == '\n')
+                len--;
+            len += snprintf(slot + len, LOG_RECORD_SIZE - len, "%s", fields);
+        }
+
+        if (len >= LOG_RECORD_SIZE)
+        {
+            slot[LOG_RECORD_SIZE - 2] = '\n';
+            atomic_fetch_add(&log_truncated, 1);
+        }
+
+        atomic_store_explicit(&log_head, head + 1, memory_order_release);
+
+        // the logger wakes up by itself every log_interval_ms, only hurry it when the ring fills up
+        if (head + 1 - tail >= LOG_RING_SIZE / 2)
+            log_wake();
+    }
+
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+// A ring is only full when commands finish faster than the disk takes their records (a script
+// piped into the shell). Then the main loop's push waits, up to LOG_FULL_WAIT_MS, for the logger to
+// make room. handle_sigchild passes wait 0: it would stall whatever it interrupted, the prompt
+// included, so its record is dropped instead. Returns -1 if still full.
+int log_wait_for_room(atomic_ulong* tail_index, unsigned long head, unsigned long* tail, int wait)
+{
+    struct timespec pause = { 0, 50000 }; // 50 us
+    int waited_us = 0;
+
+    *tail = atomic_load_explicit(tail_index, memory_order_acquire);
+    while (head - *tail == LOG_RING_SIZE)
+    {
+        if (!wait || waited_us >= LOG_FULL_WAIT_MS * 1000)
+            return -1;
+        if (waited_us == 0)
+            log_wake();
+        nanosleep(&pause, NULL);
+        waited_us += pause.tv_nsec / 1000;
+        *tail = atomic_load_explicit(tail_index, memory_order_acquire);
+    }
+    return 0;
+}
+
+// Async-signal-safe, a full wake pipe already means the logger will run
+void log_wake(void)
+{
+    int saved_errno = errno;
+    if (write(log_wake_fds[1], "", 1) == -1) {} // EAGAIN is fine
+    errno = saved_errno;
+}
+
+// Writes out whatever is queued every log_interval_ms or when woken. On SIGTERM it makes the
+// records durable and ends the shell itself, the main thread may be in the middle of anything.
+// _exit skips the atexit handlers, so what they would clean up is done here first.
+void* log_thread_main(void* arg)
+{
+    struct pollfd wake = { .fd = log_wake_fds[0], .events = POLLIN };
+    char drain[64];
+
+    while (1)
+    {
+        poll(&wake, 1, log_interval_ms);
+        while (read(log_wake_fds[0], drain, sizeof(drain)) > 0)
+            ;
+
+        int stopping = atomic_load(&log_stop);
+        log_drain();
+
+        if (log_terminate)
+        {
+            log_sync();
+            shm_unlink_stats();
+            trace_close();
+            if (compress_started)
+                pthread_join(compress_thread, NULL); // leave no half compressed segment behind
+            _exit(128 + SIGTERM);
+        }
+        if (stopping)
+        {
+            log_sync();
+            return NULL;
+        }
+    }
+}
+
+// Moves every queued record to the file with as few write(2) calls as possible. A batch only holds
+// whole records and goes out in a single O_APPEND write, which the kernel keeps in one piece even
+// when other shells append to the same file. Writing the fd directly keeps exec_times out of stdio
+// buffers that forked children would flush a second time.
+void log_drain(void)
+{
+    static char batch[LOG_BATCH_SIZE]; // only the logger thread gets here
+    size_t used = 0;
+    unsigned long tail = atomic_load_explicit(&log_tail, memory_order_relaxed);
+    unsigned long head = atomic_load_explicit(&log_head, memory_order_acquire);
 
-                if (strchr(command[i], '=') != NULL)
-                {
-                    strncpy(resource_name, command[i], strchr(command[i], '=') - command[i]);
-                    resource_name[strchr(command[i], '=') - command[i]] = '\0';
-                    strcpy(value_str, strchr(command[i], '=') + 1);
+    if (tail != head)
+        log_check_rotation();
+    log_drain_text(log_ring, &log_head, &log_tail, log_fd, "exec_times");
 
-                    if (strchr(value_str, ':') != NULL)
-                    {
-                        char temp[MAX_SIZE];
-                        strncpy(temp, value_str, strchr(value_str, ':') - value_str);
-                        temp[strchr(value_str, ':') - value_str] = '\0';
-                        soft_limit = size_value(temp);
-                        hard_limit = size_value(strchr(value_str, ':') + 1);
-                    }
-                    else
-                    {
-                        soft_limit = size_value(value_str);
-                        hard_limit = size_value(value_str);
-                    }
+    if (binlog_fd == -1)
+        return;
 
-                    if (strcmp(resource_name, "cpu") == 0)
-                        resource_code = RLIMIT_CPU;
-                    else if (strcmp(resource_name, "mem") == 0)
-                        resource_code = RLIMIT_AS;
-                    else if (strcmp(resource_name, "fsize") == 0)
-                        resource_code = RLIMIT_FSIZE;
-                    else if (strcmp(resource_name, "nofile") == 0)
-                        resource_code = RLIMIT_NOFILE;
-                    else
-                    {
-                        fprintf(stderr, "ERR: Not a valid resource\n");
-                        exit(1);
-                    }
+    // names first: a record is queued after its name, so the name is on disk no later than the record
+    log_drain_text(binlog_name_ring, &binlog_name_head, &binlog_name_tail, binlog_names_fd, "binlog names");
 
-                    if(set_rlimit(resource_code, soft_limit, hard_limit) == -1) 
-                    {
-                        perror("setrlimit");
-                        exit(1);
-                    }
-                }
-            }
+    // binary records are fixed size, copy them to the batch as they are
+    tail = atomic_load_explicit(&binlog_tail, memory_order_relaxed);
+    head = atomic_load_explicit(&binlog_head, memory_order_acquire);
+    while (tail != head)
+    {
+        if (used + sizeof(struct ex3_binlog_record) > sizeof(batch))
+        {
+            write_all(binlog_fd, batch, used);
+            used = 0;
+        }
+        memcpy(batch + used, &binlog_ring[tail & (LOG_RING_SIZE - 1)], sizeof(struct ex3_binlog_record));
+        used += sizeof(struct ex3_binlog_record);
 
-            // Create new array for the command
-            char* new_command[MAX_ARG + 1];
-            int new_index = 0;
-            
-            // Initialize new_command array to NULL
-            for (int i = 0; i <= MAX_ARG; i++) {
-                new_command[i] = NULL;
-            }
-            
-            // Copy the command and its arguments
-            for (int i = cmd_start; i < arg_count; i++) {
-                new_command[new_index++] = command[i];
-            }
-            new_command[new_index] = NULL;
+        tail++;
+        atomic_store_explicit(&binlog_tail, tail, memory_order_release);
+    }
 
-            check_dangerous_command(new_command[0], new_command, arg_count);
-            if (!handle_stderr_redirection(new_command)) {
-                exit(1);
-            }
+    if (used > 0 && write_all(binlog_fd, batch, used) == -1)
+        perror("binlog");
+}
 
-            execvp(new_command[0], new_command);
-            perror("execvp");
-            exit(1);
+// Writes the lines queued in a text ring to fd in batches of up to LOG_BATCH_SIZE
+void log_drain_text(char ring[][LOG_RECORD_SIZE], atomic_ulong* head_index, atomic_ulong* tail_index, int fd, const char* what)
+{
+    static char batch[LOG_BATCH_SIZE]; // only the logger thread gets here
+    size_t used = 0;
+    unsigned long tail = atomic_load_explicit(tail_index, memory_order_relaxed);
+    unsigned long head = atomic_load_explicit(head_index, memory_order_acquire);
+
+    while (tail != head)
+    {
+        const char* record = ring[tail & (LOG_RING_SIZE - 1)];
+        size_t len = strlen(record);
+
+        if (used + len > sizeof(batch))
+        {
+            write_all(fd, batch, used);
+            used = 0;
         }
-        else {
-            // Parent process
-            int status;
-            struct timeval start, end;
-            gettimeofday(&start, NULL);
-            wait(&status);
-            gettimeofday(&end, NULL);
-            double runtime = (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1000000.0;
+        memcpy(batch + used, record, len);
+        used += len;
 
-            if (check_process_status(status, pid, command[cmd_start], exec_times, runtime, 0)) {
-                // Update timing statistics using the new function
-                update_timing_stats(runtime, command[cmd_start]);
-            }
+        tail++;
+        atomic_store_explicit(tail_index, tail, memory_order_release); // the slot is free again
+    }
 
-            for (int i = 0; i < arg_count; i++)
-            {
-            free(command[i]);
-            command[i] = NULL;
-            }
+    if (used > 0 && write_all(fd, batch, used) == -1)
+        perror(what);
+}
+
+void log_sync(void)
+{
+    fsync(log_fd);
+    if (binlog_fd != -1)
+        fsync(binlog_fd);
+}
+
+// Opens (or creates with a header) the binary log and its .names sidecar for appending.
+// An existing log must have been written with the same record layout. Returns -1 on error.
+int binlog_open(const char* path)
+{
+    char names_path[PATH_MAX];
+    struct ex3_binlog_header header;
+    struct stat st;
+
+    snprintf(binlog_path, sizeof(binlog_path), "%s", path);
+    binlog_fd = open(path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (binlog_fd == -1 || fstat(binlog_fd, &st) == -1)
+    {
+        perror(path);
+        return -1;
+    }
+
+    if (st.st_size == 0)
+    {
+        if (binlog_write_header(binlog_fd) == -1)
+        {
+            perror(path);
+            return -1;
         }
+    }
+    else if (pread(binlog_fd, &header, sizeof(header), 0) != sizeof(header) || header.magic != EX3_BINLOG_MAGIC ||
+             header.version != EX3_BINLOG_VERSION || header.record_size != sizeof(struct ex3_binlog_record))
+    {
+        fprintf(stderr, "Error: %s is not an ex3 binary log of this version\n", path);
+        return -1;
+    }
 
-        return 1;
+    snprintf(names_path, sizeof(names_path), "%s%s", path, EX3_BINLOG_NAMES_SUFFIX);
+    binlog_names_fd = open(names_path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (binlog_names_fd == -1)
+    {
+        perror(names_path);
+        return -1;
     }
     return 0;
 }
 
-void handle_sigcpu(int signo)
+int binlog_write_header(int fd)
 {
-    printf("CPU time limit exceeded!\n");
-    exit(1);
+    struct ex3_binlog_header header;
+    memset(&header, 0, sizeof(header));
+    header.magic = EX3_BINLOG_MAGIC;
+    header.version = EX3_BINLOG_VERSION;
+    header.record_size = sizeof(struct ex3_binlog_record);
+    return write_all(fd, (const char*)&header, sizeof(header));
 }
 
-void handle_sigfsz(int signo)
+// Called by log_rotate under the exec_times lock: renames the binary log to <path>.<stamp> and
+// renames a new one, header already written, into its place, so no shell sees it without a header
+void binlog_rotate(const char* stamp)
 {
-    printf("File size limit exceeded!\n");
-    exit(1);
+    if (binlog_fd == -1)
+        return;
+
+    char temp[PATH_MAX + 32], segment[PATH_MAX + 64];
+    snprintf(temp, sizeof(temp), "%s.%d.tmp", binlog_path, (int)getpid());
+    snprintf(segment, sizeof(segment), "%s.%s", binlog_path, stamp);
+
+    int fd = open(temp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd == -1 || binlog_write_header(fd) == -1)
+    {
+        perror(temp);
+        if (fd != -1)
+        {
+            close(fd);
+            unlink(temp);
+        }
+        return;
+    }
+    close(fd);
+
+    if (rename(binlog_path, segment) == -1 || rename(temp, binlog_path) == -1)
+    {
+        perror(segment);
+        unlink(temp);
+    }
 }
 
-void handle_sigmem(int signo)
+// Points binlog_fd at the binary log now at binlog_path. Never creates it: only binlog_rotate
+// puts a new one in place, until then records keep going to the old one.
+void binlog_reopen(void)
 {
-    printf("Memory allocation failed!\n");
-    exit(1);
+    if (binlog_fd == -1)
+        return;
+
+    int fd = open(binlog_path, O_RDWR | O_APPEND | O_CLOEXEC);
+    if (fd == -1)
+        return;
+    dup2(fd, binlog_fd);
+    close(fd);
+    fcntl(binlog_fd, F_SETFD, FD_CLOEXEC); // dup2 clears it
 }
 
-void handle_signof(int signo)
+// Queues the binary record of a finished command for the logger, like log_record
+void binlog_record(const char* command_name, double runtime, int status, const struct rusage* usage)
 {
-    printf("Too many open files!\n");
-    exit(1);
-}
+    if (binlog_fd == -1 || log_owner == 0)
+        return;
 
-void handle_sigchild(int signo) {
-    pid_t pid;
-    int status;
-    while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
-        // Find the background process in our array
-        for (int i = 0; i < bg_count; i++) {
-            if (bg_processes[i].pid == pid) {
-                // Calculate runtime
-                struct timeval end;
-                gettimeofday(&end, NULL);
-                double runtime = (end.tv_sec - bg_processes[i].start_time.tv_sec) + 
-                               (end.tv_usec - bg_processes[i].start_time.tv_usec) / 1000000.0;
-                
-                // Check process status and handle accordingly
-                int success = check_process_status(status, pid, bg_processes[i].command, global_exec_times, runtime, 1);
-                
-                if (success) {
-                    // Success case - update stats
-                    update_timing_stats(runtime, bg_processes[i].command);
-                }
-                
-                // Print the prompt with updated or unchanged stats
-                printf("\n#cmd:%d|#dangerous_cmd_blocked:%d|last_cmd_time:%.5f|avg_time:%.5f|min_time:%.5f|max_time:%.5f>>",
-                      cmd, dangerous_cmd_blocked, last_cmd_time, avg_time, min_time, max_time);
-                fflush(stdout);
-                
-                // Remove the completed process from our array
-                for (int j = i; j < bg_count - 1; j++) {
-                    bg_processes[j] = bg_processes[j + 1];
-                }
-                bg_count--;
-                break;
-            }
-        }
+    struct ex3_binlog_record record;
+    struct timespec now;
+    memset(&record, 0, sizeof(record));
+    clock_gettime(CLOCK_REALTIME, &now);
+
+    record.timestamp_ns = now.tv_sec * 1000000000ULL + now.tv_nsec;
+    record.duration_ns = runtime * 1e9;
+    record.command_id = ex3_command_id(command_name);
+    record.status = status;
+    if (usage != NULL)
+    {
+        record.user_us = usage->ru_utime.tv_sec * 1000000ULL + usage->ru_utime.tv_usec;
+        record.sys_us = usage->ru_stime.tv_sec * 1000000ULL + usage->ru_stime.tv_usec;
+        record.maxrss_kb = usage->ru_maxrss;
+    }
+    else
+        record.flags |= EX3_BINLOG_IN_SHELL;
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+        record.flags |= EX3_BINLOG_FAILED;
+
+    sigset_t block, old;
+    sigemptyset(&block);
+    sigaddset(&block, SIGCHLD);
+    pthread_sigmask(SIG_BLOCK, &block, &old);
+
+    binlog_intern(record.command_id, command_name);
+
+    unsigned long head = atomic_load_explicit(&binlog_head, memory_order_relaxed);
+    unsigned long tail;
+    if (log_wait_for_room(&binlog_tail, head, &tail, !in_sigchild) == -1)
+    {
+        atomic_fetch_add(&log_dropped, 1);
+        log_wake();
+    }
+    else
+    {
+        binlog_ring[head & (LOG_RING_SIZE - 1)] = record;
+        atomic_store_explicit(&binlog_head, head + 1, memory_order_release);
+        if (head + 1 - tail >= LOG_RING_SIZE / 2)
+            log_wake();
     }
+
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
 }
 
-// Function to handle time measurements and update statistics
-void update_timing_stats(double runtime, const char* command_name)
+// Queues "<id>\t<command>" for the .names sidecar the first time this shell sees a command; the
+// logger writes it like the records, which only carry the id. Once BINLOG_KNOWN_IDS distinct
+// commands were named, newer ones are not, ex3-stats shows those by id. SIGCHLD is blocked by the caller.
+void binlog_intern(uint64_t id, const char* command_name)
 {
-    cmd++;
-    last_cmd_time = runtime;
-    total_time += runtime;
-    avg_time = total_time / cmd;
+    uint64_t key = id != 0 ? id : 1; // 0 marks an empty slot
+    unsigned int slot = key & (BINLOG_KNOWN_IDS - 1);
+    int probe = 0;
 
-    if (runtime > max_time)
-        max_time = runtime;
+    for (; probe < BINLOG_KNOWN_IDS && binlog_known_ids[slot] != 0; probe++)
+    {
+        if (binlog_known_ids[slot] == key)
+            return;
+        slot = (slot + 1) & (BINLOG_KNOWN_IDS - 1);
+    }
+    if (probe == BINLOG_KNOWN_IDS)
+        return; // the table is full
 
-    if (runtime < min_time || min_time == 0)
-        min_time = runtime;
+    unsigned long head = atomic_load_explicit(&binlog_name_head, memory_order_relaxed);
+    unsigned long tail;
+    if (log_wait_for_room(&binlog_name_tail, head, &tail, !in_sigchild) == -1)
+    {
+        atomic_fetch_add(&log_dropped, 1); // left unknown, the next run of the command tries again
+        log_wake();
+        return;
+    }
 
-    // Write to exec_times file
-    fprintf(global_exec_times, "%s : %.5f sec\n", command_name, runtime);
-    fflush(global_exec_times);
+    char* line = binlog_name_ring[head & (LOG_RING_SIZE - 1)];
+    int len = snprintf(line, LOG_RECORD_SIZE, "%016llx\t%s\n", (unsigned long long)id, command_name);
+    if (len >= LOG_RECORD_SIZE)
+        line[LOG_RECORD_SIZE - 2] = '\n';
+    binlog_known_ids[slot] = key;
+    atomic_store_explicit(&binlog_name_head, head + 1, memory_order_release);
+    if (head + 1 - tail >= LOG_RING_SIZE / 2)
+        log_wake();
+}
+
+// Flushes every queued record to disk and stops the logger; only the shell itself does anything
+void log_shutdown(void)
+{
+    if (log_owner == 0 || log_owner != getpid())
+        return;
+    log_owner = 0;
+
+    atomic_store(&log_stop, 1);
+    log_wake();
+    pthread_join(log_thread, NULL);
+    if (compress_started)
+        pthread_join(compress_thread, NULL); // leave no half compressed segment behind
+
+    unsigned long dropped = atomic_load(&log_dropped);
+    unsigned long truncated = atomic_load(&log_truncated);
+    if (dropped > 0 || truncated > 0)
+        fprintf(stderr, "exec_times: %lu records dropped, %lu truncated\n", dropped, truncated);
 }
 
 int check_process_status(int status, pid_t pid, const char* cmd_name, FILE* exec_file, double runtime, int is_background)
@@ -1098,8 +5749,7 @@ int check_process_status(int status, pid_t pid, const char* cmd_name, FILE* exec
             if (is_background) {
                 printf("\nBackground process [%d] failed: %s with exit code %d\n", pid, cmd_name, exit_code);
                 if (exec_file != NULL) {
-                    fprintf(exec_file, "%s : failed with exit code %d (background)\n", cmd_name, exit_code);
-                    fflush(exec_file);
+                    log_record("%s : failed with exit code %d (background)\n", cmd_name, exit_code);
                 }
             } else {
                 printf("Error: Command '%s' exited with code %d\n", cmd_name, exit_code);
@@ -1134,8 +5784,7 @@ int check_process_status(int status, pid_t pid, const char* cmd_name, FILE* exec
         if (is_background) {
             printf(" - %s\n", cmd_name);
             if (exec_file != NULL) {
-                fprintf(exec_file, "%s : terminated by signal %d (background)\n", cmd_name, signal_num);
-                fflush(exec_file);
+                log_record("%s : terminated by signal %d (background)\n", cmd_name, signal_num);
             }
         } else {
             printf("\n");
@@ -1146,41 +5795,164 @@ int check_process_status(int status, pid_t pid, const char* cmd_name, FILE* exec
     return 0; // Failure
 }
 
-int handle_stderr_redirection(char* command[]) {
-    char* stderr_file = NULL;
-    
-    // Check for stderr redirection
-    for (int i = 0; command[i] != NULL; i++) {
-        if (strcmp(command[i], "2>") == 0) {
-            if (command[i+1] != NULL) {
-                stderr_file = command[i+1];
-                // Remove the 2> and filename from command
-                for (int j = i; command[j] != NULL; j++) {
-                    if (command[j+2] != NULL) {
-                        command[j] = command[j+2];
-                    } else {
-                        command[j] = NULL;
-                        break;
-                    }
-                }
-                
-                // Found 2>, now handle the redirection
-                int fd = open(stderr_file, O_WRONLY | O_CREAT | O_APPEND, 0644);
-                if (fd == -1) {
-                    perror("open");
-                    return 0;
-                }
-                if (dup2(fd, STDERR_FILENO) == -1) {
-                    perror("dup2");
-                    close(fd);
-                    return 0;
-                }
+// Takes every redirection out of command (freeing its words) into redirect, in the order written.
+// A redirection is a word made of an optional fd number, <, > or >>, and a file name or &fd; the
+// file name may also be the next word ("2> err.log" or "2>err.log").
+// Returns the new argument count, or -1 for a malformed redirection or nothing left to run.
+int parse_redirections(char* command[], int arg_count, struct redirections* redirect)
+{
+    int kept = 0;
+    redirect->count = 0;
+
+    for (int i = 0; i < arg_count && command[i] != NULL; i++)
+    {
+        struct redirect entry;
+        int result = parse_redirect_word(command[i], &entry);
+
+        if (result == 0) // an ordinary argument
+        {
+            command[kept++] = command[i];
+            continue;
+        }
+
+        if (result == 1 && entry.type != REDIRECT_DUP && entry.path[0] == '\0')
+        {
+            // the file name is the next word
+            if (i + 1 >= arg_count || command[i + 1] == NULL)
+                result = -1;
+            else
+            {
+                strcpy(entry.path, command[i + 1]);
+                free(command[i]);
+                command[i] = NULL;
+                i++;
+            }
+        }
+
+        if (result == -1 || redirect->count == MAX_REDIRECTS)
+        {
+            // keep what is left owned by command so the caller can free it
+            for (int j = i; j < arg_count && command[j] != NULL; j++)
+                command[kept++] = command[j];
+            for (int j = kept; j < arg_count; j++)
+                command[j] = NULL;
+            return -1;
+        }
+
+        redirect->entries[redirect->count++] = entry;
+        free(command[i]);
+        command[i] = NULL;
+    }
+
+    for (int i = kept; i < arg_count; i++)
+        command[i] = NULL;
+
+    if (kept == 0)
+        return -1;
+    return kept;
+}
+
+// Returns 1 if word is a redirection (path is left empty when the file is the next word),
+// 0 if it is an ordinary argument, -1 if it is a malformed redirection
+int parse_redirect_word(const char* word, struct redirect* entry)
+{
+    const char* p = word;
+    while (isdigit(*p))
+        p++;
+    if (*p != '>' && *p != '<')
+        return 0;
+
+    int fd = -1;
+    if (p != word)
+    {
+        fd = atoi(word);
+        if (p - word > 4 || fd > MAX_REDIRECT_FD)
+            return -1;
+    }
+
+    if (*p == '>')
+    {
+        p++;
+        entry->type = REDIRECT_TRUNCATE;
+        if (*p == '>')
+        {
+            entry->type = REDIRECT_APPEND;
+            p++;
+        }
+        entry->fd = fd == -1 ? STDOUT_FILENO : fd;
+    }
+    else
+    {
+        p++;
+        entry->type = REDIRECT_READ;
+        entry->fd = fd == -1 ? STDIN_FILENO : fd;
+    }
+
+    entry->path[0] = '\0';
+    if (*p == '&')
+    {
+        // n>&m duplicates m, there is no appending variant
+        p++;
+        if (entry->type == REDIRECT_APPEND || !isdigit(*p))
+            return -1;
+        entry->type = REDIRECT_DUP;
+        entry->source_fd = atoi(p);
+        int digits = strspn(p, "0123456789");
+        return p[digits] == '\0' && digits <= 4 && entry->source_fd <= MAX_REDIRECT_FD ? 1 : -1;
+    }
+
+    // 2> has always appended to its file in this shell, existing error logs must not be wiped
+    if (entry->type == REDIRECT_TRUNCATE && entry->fd == STDERR_FILENO)
+        entry->type = REDIRECT_APPEND;
+
+    if (strlen(p) >= MAX_SIZE)
+        return -1;
+    strcpy(entry->path, p);
+    return 1;
+}
+
+// Runs in the child: opens and dup2s every redirection left to right, like a POSIX shell, so
+// "> out 2>&1" sends both streams to out while "2>&1 > out" keeps stderr on the old stdout
+int apply_redirections(const struct redirections* redirect)
+{
+    for (int i = 0; i < redirect->count; i++)
+    {
+        const struct redirect* entry = &redirect->entries[i];
+
+        if (entry->type == REDIRECT_DUP)
+        {
+            if (entry->source_fd != entry->fd && dup2(entry->source_fd, entry->fd) == -1)
+            {
+                fprintf(stderr, "%d>&%d: %s\n", entry->fd, entry->source_fd, strerror(errno));
+                return -1;
+            }
+            continue;
+        }
+
+        int flags = O_RDONLY;
+        if (entry->type == REDIRECT_TRUNCATE)
+            flags = O_WRONLY | O_CREAT | O_TRUNC;
+        else if (entry->type == REDIRECT_APPEND)
+            flags = O_WRONLY | O_CREAT | O_APPEND;
+
+        int fd = open(entry->path, flags, 0644);
+        if (fd == -1)
+        {
+            perror(entry->path);
+            return -1;
+        }
+        if (fd != entry->fd)
+        {
+            if (dup2(fd, entry->fd) == -1)
+            {
+                perror("dup2");
                 close(fd);
-                return 1;
+                return -1;
             }
+            close(fd);
         }
     }
-    return 1; // No redirection found, return success
+    return 0;
 }
 
 int mcalc_format_check(char* command[], int arg_count, struct matrix* matrices[], int* matrix_count,int* operation)
@@ -1363,6 +6135,9 @@ void free_matrices(struct matrix* matrices[], int matrix_count)
 void* matrices_calculation(void* arg)
 {
     struct thread_data* td = (struct thread_data*)arg;
+    uint64_t begin = trace_fd != -1 ? realtime_us() : 0;
+    int size = td->matrices[0]->size;
+    int operation = td->operation;
 
     for (int i = 0; i < td->matrices[0]->size; i++)
     {
@@ -1379,6 +6154,13 @@ void* matrices_calculation(void* arg)
     //free 
     free(td->matrices[1]);
     free(td);
+
+    if (trace_fd != -1)
+    {
+        char args[64];
+        snprintf(args, sizeof(args), "\"elements\":%d", size);
+        trace_span("mcalc", operation == 1 ? "ADD" : "SUB", gettid(), begin, realtime_us(), args);
+    }
     
     return NULL;
 }
@@ -1406,6 +6188,10 @@ void handle_mcalc(char* command[], int arg_count)
         return;
     }
 
+    struct timeval parsed, computed;
+    if (trace_fd != -1)
+        gettimeofday(&parsed, NULL);
+
     while (matrix_count > 1)
     {
         int size = matrix_count/2;
@@ -1425,8 +6211,13 @@ void handle_mcalc(char* command[], int arg_count)
             td->matrices[0] = matrices[2*i];
             td->matrices[1] = matrices[2*i+1];
 
-            //create thread
+            //create thread, with SIGCHLD blocked so handle_sigchild stays on the main thread
+            sigset_t block, old;
+            sigemptyset(&block);
+            sigaddset(&block, SIGCHLD);
+            pthread_sigmask(SIG_BLOCK, &block, &old);
             pthread_create(&threads[i],NULL,matrices_calculation,(void*)td);
+            pthread_sigmask(SIG_SETMASK, &old, NULL);
 
             //save result matrix
             matrices[i] = td->matrices[0];
@@ -1446,6 +6237,9 @@ void handle_mcalc(char* command[], int arg_count)
         matrix_count = size + (matrix_count % 2); //update count
     }
 
+    if (trace_fd != -1)
+        gettimeofday(&computed, NULL);
+
     printf("Output: (%d,%d:", matrices[0]->rows, matrices[0]->cols);
     for (int i = 0; i < matrices[0]->size; i++) {
         printf("%d", matrices[0]->data[i]);
@@ -1461,6 +6255,12 @@ void handle_mcalc(char* command[], int arg_count)
 
     // Calculate and update timing statistics
     gettimeofday(&end, NULL);
+    if (trace_fd != -1)
+    {
+        trace_span("mcalc", "parse", gettid(), timeval_us(&start), timeval_us(&parsed), NULL);
+        trace_span("mcalc", "compute", gettid(), timeval_us(&parsed), timeval_us(&computed), NULL);
+        trace_span("mcalc", "print", gettid(), timeval_us(&computed), timeval_us(&end), NULL);
+    }
     double runtime = (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1000000.0;
     update_timing_stats(runtime, "mcalc");
 }
@@ -0,0 +1,683 @@
+// Pipeline throughput benchmark for the ex3 shell.
+//
+// Drives producer/consumer pipelines, my_tee and fan-outs through a real ex3 process at different
+// data sizes and line lengths, once with the default pipe capacity and once with an enlarged one
+// (pipesize=), and reports MB/s and how much CPU the shell process itself used.
+//
+//   ./ex3_bench ./ex3 [--quick]
+//
+// Stress mode starts many shells appending to one exec_times file at once and checks that every
+// record arrives intact and exactly once (pid and seq fields identify each one):
+//   ./ex3_bench stress ./ex3 [shells] [records per shell]
+//
+// Check mode runs scripted sessions, some starting from a prepared exec_times, and compares what
+// "stats" prints with the values the records add up to (resume, LRU eviction, sliding window):
+//   ./ex3_bench check ./ex3
+//
+// The same binary is also the producer and consumer the shell runs:
+//   ./ex3_bench gen <bytes> <line_length>   writes lines of line_length bytes to stdout
+//   ./ex3_bench sink                        reads stdin until end of input
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/time.h>
+#include <sys/stat.h>
+
+#define MAX_SIZE 1025
+#define CHUNK_SIZE (64 * 1024)
+#define BYTES_IN_MB (1024.0 * 1024.0)
+#define ENLARGED_PIPE_SIZE "1M"
+#define STRESS_SHELLS 16
+#define STRESS_RECORDS 2000
+#define STRESS_COMMAND "jobs" // a builtin: one record per line and no fork
+#define CHECK_EXPECTED 8
+#define CHECK_NAMES 129 // one more command name than the shell keeps stats for
+#define CHECK_OUTPUT_SIZE (256 * 1024)
+
+struct scenario
+{
+    const char* name;
+    const char* format; // command line, %1$s is the bench binary, %2$llu the size, %3$d the line length
+};
+
+// A scripted session of check mode. Each expected text has to appear in the shell's output, in
+// this order, after the previous one.
+struct check_case
+{
+    const char* name;
+    const char* exec_times; // written to exec_times before the shell starts, NULL continues the previous case's file
+    const char* option; // one more argument for the shell, or NULL
+    const char* input; // lines for the shell, "#sleep <ms>" pauses instead of sending a line
+    const char* expected[CHECK_EXPECTED];
+};
+
+// every scenario ends in sinks so nothing is printed to the terminal
+struct scenario scenarios[] = {
+    { "pipe", "%1$s gen %2$llu %3$d | %1$s sink" },
+    { "pipe3", "%1$s gen %2$llu %3$d | %1$s sink-copy | %1$s sink" },
+    { "my_tee", "%1$s gen %2$llu %3$d | my_tee /dev/null | %1$s sink" },
+    { "my_tee2", "%1$s gen %2$llu %3$d | my_tee /dev/null | my_tee /dev/null | %1$s sink" },
+    { "fan-out", "%1$s gen %2$llu %3$d |> %1$s sink , %1$s sink" },
+};
+
+int write_all(int fd, const char* buffer, size_t len);
+int check(const char* shell);
+int run_check_case(const char* shell, const char* directory, const struct check_case* cc);
+int write_file(const char* path, const char* text);
+char* eviction_log(void);
+int generate(unsigned long long bytes, int line_length);
+int sink(int copy);
+int run_scenario(const char* shell, const char* bench, const struct scenario* sc, unsigned long long bytes, int line_length, const char* pipe_size, double* runtime, double* shell_cpu);
+int read_shell_cpu(pid_t pid, double* cpu);
+int find_total_runtime(const char* exec_times, double* runtime);
+int stress(const char* shell, int shells, int records);
+pid_t start_stress_shell(const char* shell, const char* dangerous, const char* exec_times, int records);
+int check_stress_log(const char* exec_times, pid_t pids[], int shells, int records);
+
+int main(int argc, char* argv[])
+{
+    if (argc >= 4 && strcmp(argv[1], "gen") == 0)
+        return generate(strtoull(argv[2], NULL, 10), atoi(argv[3]));
+    if (argc == 2 && strcmp(argv[1], "sink") == 0)
+        return sink(0);
+    if (argc == 2 && strcmp(argv[1], "sink-copy") == 0)
+        return sink(1);
+
+    if (argc >= 3 && strcmp(argv[1], "stress") == 0)
+        return stress(argv[2], argc > 3 ? atoi(argv[3]) : STRESS_SHELLS, argc > 4 ? atoi(argv[4]) : STRESS_RECORDS);
+    if (argc == 3 && strcmp(argv[1], "check") == 0)
+        return check(argv[2]);
+
+    if (argc < 2)
+    {
+        fprintf(stderr, "usage: %s <path to ex3> [--quick]\n       %s stress <path to ex3> [shells] [records]\n       %s check <path to ex3>\n",
+                argv[0], argv[0], argv[0]);
+        return 1;
+    }
+
+    int quick = argc > 2 && strcmp(argv[2], "--quick") == 0;
+    unsigned long long sizes[] = { 16ULL << 20, 256ULL << 20 };
+    int line_lengths[] = { 16, 256, 4096 };
+    const char* pipe_sizes[] = { "default", ENLARGED_PIPE_SIZE };
+    int size_count = quick ? 1 : 2;
+
+    // the shell execs us by path, so make it absolute
+    char bench[MAX_SIZE];
+    if (realpath(argv[0], bench) == NULL)
+    {
+        perror(argv[0]);
+        return 1;
+    }
+
+    printf("%-8s %8s %6s %9s %10s %10s %8s\n", "scenario", "size", "line", "pipesize", "MB/s", "shell_cpu", "cpu%");
+
+    for (int sc = 0; sc < (int)(sizeof(scenarios) / sizeof(scenarios[0])); sc++)
+    {
+        for (int sz = 0; sz < size_count; sz++)
+        {
+            for (int ln = 0; ln < 3; ln++)
+            {
+                for (int ps = 0; ps < 2; ps++)
+                {
+                    double runtime, shell_cpu;
+                    if (run_scenario(argv[1], bench, &scenarios[sc], sizes[sz], line_lengths[ln], pipe_sizes[ps], &runtime, &shell_cpu) == -1)
+                    {
+                        printf("%-8s %7lluM %6d %9s %10s\n", scenarios[sc].name, sizes[sz] >> 20, line_lengths[ln], pipe_sizes[ps], "failed");
+                        continue;
+                    }
+
+                    printf("%-8s %7lluM %6d %9s %10.1f %9.3fs %7.1f%%\n", scenarios[sc].name, sizes[sz] >> 20, line_lengths[ln], pipe_sizes[ps],
+                           sizes[sz] / BYTES_IN_MB / runtime, shell_cpu, shell_cpu / runtime * 100.0);
+                    fflush(stdout);
+                }
+            }
+        }
+    }
+
+    return 0;
+}
+
+int write_all(int fd, const char* buffer, size_t len)
+{
+    while (len > 0)
+    {
+        ssize_t written = write(fd, buffer, len);
+        if (written == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        buffer += written;
+        len -= written;
+    }
+    return 0;
+}
+
+// Writes bytes of line_length long lines, each write is one line so short lines mean many small writes
+int generate(unsigned long long bytes, int line_length)
+{
+    char buffer[CHUNK_SIZE];
+
+    if (line_length < 1 || line_length > CHUNK_SIZE)
+        return 1;
+
+    memset(buffer, 'x', sizeof(buffer));
+    for (int i = line_length - 1; i < CHUNK_SIZE; i += line_length)
+        buffer[i] = '\n';
+
+    while (bytes > 0)
+    {
+        size_t len = bytes < (unsigned long long)line_length ? bytes : (size_t)line_length;
+        if (write_all(STDOUT_FILENO, buffer, len) == -1)
+            return 1;
+        bytes -= len;
+    }
+
+    return 0;
+}
+
+// Reads stdin to the end, with copy set it also passes the data on to stdout
+int sink(int copy)
+{
+    static char buffer[4 * CHUNK_SIZE];
+
+    while (1)
+    {
+        ssize_t n = read(STDIN_FILENO, buffer, sizeof(buffer));
+        if (n == 0)
+            return 0;
+        if (n == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            return 1;
+        }
+        if (copy && write_all(STDOUT_FILENO, buffer, n) == -1)
+            return 1;
+    }
+}
+
+// Runs one command line in a fresh ex3 and measures it. The runtime is the pipeline/fan-out total the
+// shell logs to exec_times, shell_cpu is the user+system time of the ex3 process itself (not its children)
+// read from /proc just before it is told to exit.
+int run_scenario(const char* shell, const char* bench, const struct scenario* sc, unsigned long long bytes, int line_length, const char* pipe_size, double* runtime, double* shell_cpu)
+{
+    char dangerous[] = "/tmp/ex3_bench_dangerous_XXXXXX";
+    char exec_times[] = "/tmp/ex3_bench_exec_times_XXXXXX";
+    int dangerous_fd = mkstemp(dangerous);
+    int exec_times_fd = mkstemp(exec_times);
+    if (dangerous_fd == -1 || exec_times_fd == -1)
+    {
+        perror("mkstemp");
+        return -1;
+    }
+    close(dangerous_fd);
+    close(exec_times_fd);
+
+    int input[2];
+    if (pipe(input) == -1)
+    {
+        perror("pipe");
+        return -1;
+    }
+
+    pid_t pid = fork();
+    if (pid == -1)
+    {
+        perror("fork");
+        return -1;
+    }
+    if (pid == 0)
+    {
+        dup2(input[0], STDIN_FILENO);
+        close(input[0]);
+        close(input[1]);
+
+        int null_fd = open("/dev/null", O_WRONLY); // prompts and my_tee reports
+        dup2(null_fd, STDOUT_FILENO);
+        dup2(null_fd, STDERR_FILENO);
+        close(null_fd);
+
+        execl(shell, shell, dangerous, exec_times, (char*)NULL);
+        _exit(127);
+    }
+    close(input[0]);
+
+    char line[MAX_SIZE * 2];
+    int len = snprintf(line, sizeof(line), "pipesize=%s\n", pipe_size);
+    len += snprintf(line + len, sizeof(line) - len, sc->format, bench, bytes, line_length);
+    len += snprintf(line + len, sizeof(line) - len, "\n");
+
+    int result = write_all(input[1], line, len);
+
+    // wait for the total record, then sample the shell's own cpu time before it exits
+    *runtime = -1;
+    while (result == 0 && find_total_runtime(exec_times, runtime) == -1)
+    {
+        if (waitpid(pid, NULL, WNOHANG) == pid)
+        {
+            result = -1;
+            pid = -1;
+            break;
+        }
+        usleep(10000);
+    }
+
+    if (result == 0 && read_shell_cpu(pid, shell_cpu) == -1)
+        result = -1;
+
+    write_all(input[1], "done\n", 5);
+    close(input[1]);
+    if (pid > 0)
+        waitpid(pid, NULL, 0);
+
+    unlink(dangerous);
+    unlink(exec_times);
+
+    return *runtime > 0 ? result : -1;
+}
+
+// utime + stime of the process itself (fields 14 and 15 of /proc/<pid>/stat)
+int read_shell_cpu(pid_t pid, double* cpu)
+{
+    char path[64];
+    char buffer[MAX_SIZE];
+
+    snprintf(path, sizeof(path), "/proc/%d/stat", (int)pid);
+    FILE* file = fopen(path, "r");
+    if (file == NULL)
+        return -1;
+    size_t n = fread(buffer, 1, sizeof(buffer) - 1, file);
+    fclose(file);
+    buffer[n] = '\0';
+
+    char* fields = strrchr(buffer, ')');
+    unsigned long utime, stime;
+    if (fields == NULL || sscanf(fields + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu", &utime, &stime) != 2)
+        return -1;
+
+    *cpu = (utime + stime) / (double)sysconf(_SC_CLK_TCK);
+    return 0;
+}
+
+// Looks for the "(pipeline, ...)" or "(fan-out, ...)" record the shell writes once everything was reaped
+int find_total_runtime(const char* exec_times, double* runtime)
+{
+    FILE* file = fopen(exec_times, "r");
+    if (file == NULL)
+        return -1;
+
+    char line[MAX_SIZE * 2];
+    int found = -1;
+    while (fgets(line, sizeof(line), file) != NULL)
+    {
+        if (strstr(line, "(pipeline,") == NULL && strstr(line, "(fan-out,") == NULL)
+            continue;
+
+        char* separator = strstr(line, " : ");
+        if (separator != NULL && sscanf(separator + 3, "%lf", runtime) == 1)
+            found = 0;
+    }
+
+    fclose(file);
+    return found;
+}
+
+// Runs shells concurrent ex3 instances on one exec_times file, each logging records records,
+// and verifies the result. Returns 0 if all shells*records records are intact and unique.
+int stress(const char* shell, int shells, int records)
+{
+    char dangerous[] = "/tmp/ex3_stress_dangerous_XXXXXX";
+    char exec_times[] = "/tmp/ex3_stress_exec_times_XXXXXX";
+    pid_t pids[shells];
+    struct timeval start, end;
+
+    if (shells < 1 || records < 1)
+    {
+        fprintf(stderr, "stress: shells and records must be positive\n");
+        return 1;
+    }
+
+    int dangerous_fd = mkstemp(dangerous);
+    int exec_times_fd = mkstemp(exec_times);
+    if (dangerous_fd == -1 || exec_times_fd == -1)
+    {
+        perror("mkstemp");
+        return 1;
+    }
+    close(dangerous_fd);
+    close(exec_times_fd);
+
+    gettimeofday(&start, NULL);
+    for (int i = 0; i < shells; i++)
+    {
+        pids[i] = start_stress_shell(shell, dangerous, exec_times, records);
+        if (pids[i] == -1)
+            return 1;
+    }
+
+    int failed_shells = 0;
+    for (int i = 0; i < shells; i++)
+    {
+        int status;
+        waitpid(pids[i], &status, 0);
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+            failed_shells++;
+    }
+    gettimeofday(&end, NULL);
+    double runtime = (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1000000.0;
+
+    printf("%d shells x %d records in %.3f sec (%.0f records/s)\n", shells, records, runtime, shells * records / runtime);
+    if (failed_shells > 0)
+        printf("%d shells did not exit cleanly\n", failed_shells);
+
+    int result = check_stress_log(exec_times, pids, shells, records);
+
+    unlink(dangerous);
+    unlink(exec_times);
+    return result == 0 && failed_shells == 0 ? 0 : 1;
+}
+
+// One shell logging with pid and seq fields, fed its whole input up front
+pid_t start_stress_shell(const char* shell, const char* dangerous, const char* exec_times, int records)
+{
+    int input[2];
+    if (pipe(input) == -1)
+    {
+        perror("pipe");
+        return -1;
+    }
+
+    pid_t pid = fork();
+    if (pid == -1)
+    {
+        perror("fork");
+        return -1;
+    }
+    if (pid == 0)
+    {
+        dup2(input[0], STDIN_FILENO);
+        close(input[0]);
+        close(input[1]);
+
+        int null_fd = open("/dev/null", O_WRONLY);
+        dup2(null_fd, STDOUT_FILENO);
+        close(null_fd);
+
+        execl(shell, shell, dangerous, exec_times, "--log-fields=pid,seq", (char*)NULL);
+        _exit(127);
+    }
+    close(input[0]);
+
+    // a writer child, so a full pipe never stalls starting the other shells
+    if (fork() == 0)
+    {
+        for (int i = 0; i < records; i++)
+            write_all(input[1], STRESS_COMMAND "\n", strlen(STRESS_COMMAND) + 1);
+        write_all(input[1], "done\n", 5);
+        _exit(0);
+    }
+    close(input[1]);
+    return pid;
+}
+
+// Every line must be "jobs : <time> sec [pid P, seq S]" with P one of the shells and each
+// (P, S) with S in 1..records exactly once
+int check_stress_log(const char* exec_times, pid_t pids[], int shells, int records)
+{
+    FILE* file = fopen(exec_times, "r");
+    if (file == NULL)
+    {
+        perror(exec_times);
+        return -1;
+    }
+
+    unsigned char* seen = calloc((size_t)shells * records, 1);
+    char line[MAX_SIZE * 2];
+    long lines = 0, torn = 0, duplicates = 0, missing = 0;
+
+    while (fgets(line, sizeof(line), file) != NULL)
+    {
+        double runtime;
+        int pid, end = 0;
+        long seq;
+        lines++;
+
+        if (sscanf(line, STRESS_COMMAND " : %lf sec [pid %d, seq %ld]\n%n", &runtime, &pid, &seq, &end) != 3 || end != (int)strlen(line))
+        {
+            torn++;
+            continue;
+        }
+
+        int shell = -1;
+        for (int i = 0; i < shells; i++)
+        {
+            if (pids[i] == pid)
+                shell = i;
+        }
+        if (shell == -1 || seq < 1 || seq > records)
+        {
+            torn++;
+            continue;
+        }
+
+        unsigned char* flag = &seen[(size_t)shell * records + seq - 1];
+        if (*flag)
+            duplicates++;
+        *flag = 1;
+    }
+    fclose(file);
+
+    for (size_t i = 0; i < (size_t)shells * records; i++)
+        missing += !seen[i];
+    free(seen);
+
+    printf("%ld lines, expected %ld: %ld torn, %ld duplicated, %ld missing\n", lines, (long)shells * records, torn, duplicates, missing);
+    if (torn == 0 && duplicates == 0 && missing == 0 && lines == (long)shells * records)
+    {
+        printf("PASS\n");
+        return 0;
+    }
+    printf("FAIL\n");
+    return -1;
+}
+
+int check(const char* shell)
+{
+    struct check_case cases[] = {
+        // a command with " : " in it, a failed stage, pipeline and fan-out totals and a background
+        // failure: only the two echo lines and the true stage count for the prompt
+        { "resume", "echo a : b : 0.50000 sec\n"
+                    "echo x : 0.25000 sec [pid 7, seq 2]\n"
+                    "false : failed 0.12500 sec (stage 1/2, exit 1)\n"
+                    "true : 0.12500 sec (stage 2/2, exit 0)\n"
+                    "false | true : 0.75000 sec (pipeline, 2 stages)\n"
+                    "true |> true , true : 2.00000 sec (fan-out, 2 consumers)\n"
+                    "sleep 1 & : failed with exit code 2 (background)\n",
+          "--resume-stats", "stats\nstats echo\nstats false\nstats true\nstats sleep\n",
+          { "#cmd:3|", "max_time:0.50000|", "all: count=3 mean=0.29167 ", "echo: count=2 failed=0 total=0.75000 mean=0.37500 ",
+            "false: count=1 failed=1 total=0.12500 ", "true: count=1 failed=0 total=0.12500 ", "ERR" } },
+        // the checkpoint of the last case, plus its four stats records
+        { "checkpoint", NULL, "--resume-stats", "stats stats\nstats echo\n",
+          { "#cmd:7|", "stats: count=4 failed=0 ", "echo: count=2 failed=0 total=0.75000 " } },
+        // cmd0 ran again before cmd128 came, so cmd1 made room; the stats record of
+        // "stats cmd0" then takes the place of cmd2
+        { "eviction", "", "--resume-stats", "stats cmd1\nstats cmd0\nstats cmd2\nstats cmd128\n",
+          { "ERR", "cmd0: count=2 failed=0 total=0.00200 ", "ERR", "cmd128: count=1 failed=0 " } },
+        // written live, read back by the next case
+        { "pipeline", "", NULL, "false | true\nstats false\nstats true\nstats\n",
+          { "false: count=1 failed=1 ", "true: count=1 failed=0 ", "all: count=3 " } },
+        { "pipeline resumed", NULL, "--resume-stats", "stats false\n",
+          { "#cmd:4|", "false: count=1 failed=1 " } },
+        // the window keeps the newest N, then only what finished in the last T seconds
+        { "window", "", "--stats-window=2", "true\ntrue\ntrue\nstats\nstats window 1s\ntrue\nstats\n#sleep 1500\nstats\n",
+          { "last 2 commands: count=2 ", "last 1s: count=2 ", "last 1s: count=0 mean=0.00000 " } },
+    };
+    int count = sizeof(cases) / sizeof(cases[0]);
+
+    char* eviction = eviction_log();
+    char directory[] = "/tmp/ex3_check_XXXXXX";
+    if (eviction == NULL || mkdtemp(directory) == NULL)
+    {
+        perror("check");
+        return 1;
+    }
+    for (int i = 0; i < count; i++)
+    {
+        if (strcmp(cases[i].name, "eviction") == 0)
+            cases[i].exec_times = eviction;
+    }
+
+    int failed = 0;
+    for (int i = 0; i < count; i++)
+        failed += run_check_case(shell, directory, &cases[i]) == -1;
+
+    const char* files[] = { "dangerous", "exec_times", "exec_times.stats", "output" };
+    char path[PATH_MAX];
+    for (int i = 0; i < (int)(sizeof(files) / sizeof(files[0])); i++)
+    {
+        snprintf(path, sizeof(path), "%s/%s", directory, files[i]);
+        unlink(path);
+    }
+    rmdir(directory);
+    free(eviction);
+
+    printf("%d of %d cases passed\n%s\n", count - failed, count, failed == 0 ? "PASS" : "FAIL");
+    return failed == 0 ? 0 : 1;
+}
+
+// One session of the shell in directory, its output checked against cc->expected
+int run_check_case(const char* shell, const char* directory, const struct check_case* cc)
+{
+    char dangerous[PATH_MAX], exec_times[PATH_MAX], checkpoint[PATH_MAX], output[PATH_MAX];
+    snprintf(dangerous, sizeof(dangerous), "%s/dangerous", directory);
+    snprintf(exec_times, sizeof(exec_times), "%s/exec_times", directory);
+    snprintf(checkpoint, sizeof(checkpoint), "%s/exec_times.stats", directory);
+    snprintf(output, sizeof(output), "%s/output", directory);
+
+    if (cc->exec_times != NULL)
+    {
+        unlink(checkpoint);
+        if (write_file(exec_times, cc->exec_times) == -1)
+            return -1;
+    }
+    if (write_file(dangerous, "") == -1)
+        return -1;
+
+    int input[2];
+    if (pipe(input) == -1)
+    {
+        perror("pipe");
+        return -1;
+    }
+
+    pid_t pid = fork();
+    if (pid == -1)
+    {
+        perror("fork");
+        return -1;
+    }
+    if (pid == 0)
+    {
+        dup2(input[0], STDIN_FILENO);
+        close(input[0]);
+        close(input[1]);
+
+        int output_fd = open(output, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        dup2(output_fd, STDOUT_FILENO);
+        dup2(output_fd, STDERR_FILENO);
+        close(output_fd);
+
+        execl(shell, shell, dangerous, exec_times, cc->option, (char*)NULL);
+        _exit(127);
+    }
+    close(input[0]);
+
+    // line by line, so a pause falls between the commands around it
+    for (const char* line = cc->input; *line != '\0';)
+    {
+        size_t len = strcspn(line, "\n");
+        if (strncmp(line, "#sleep ", 7) == 0)
+            usleep(atoi(line + 7) * 1000);
+        else
+        {
+            write_all(input[1], line, len);
+            write_all(input[1], "\n", 1);
+        }
+        line += len + (line[len] == '\n');
+    }
+    write_all(input[1], "done\n", 5);
+    close(input[1]);
+
+    int status;
+    waitpid(pid, &status, 0);
+
+    static char text[CHECK_OUTPUT_SIZE];
+    FILE* file = fopen(output, "r");
+    if (file == NULL)
+    {
+        perror(output);
+        return -1;
+    }
+    size_t got = fread(text, 1, sizeof(text) - 1, file);
+    text[got] = '\0';
+    fclose(file);
+
+    const char* from = text;
+    for (int i = 0; i < CHECK_EXPECTED && cc->expected[i] != NULL; i++)
+    {
+        const char* found = strstr(from, cc->expected[i]);
+        if (found == NULL)
+        {
+            printf("%-20s FAIL: \"%s\" not in the output after \"%.40s\"\n", cc->name, cc->expected[i], from);
+            return -1;
+        }
+        from = found + strlen(cc->expected[i]);
+    }
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+    {
+        printf("%-20s FAIL: the shell did not exit cleanly\n", cc->name);
+        return -1;
+    }
+
+    printf("%-20s ok\n", cc->name);
+    return 0;
+}
+
+int write_file(const char* path, const char* text)
+{
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1 || write_all(fd, text, strlen(text)) == -1)
+    {
+        perror(path);
+        if (fd != -1)
+            close(fd);
+        return -1;
+    }
+    return close(fd);
+}
+
+// cmd0 to cmd127 once, cmd0 again, then cmd128, 0.001 sec each (malloc'ed)
+char* eviction_log(void)
+{
+    size_t size = (CHECK_NAMES + 1) * 32;
+    char* log = malloc(size);
+    if (log == NULL)
+        return NULL;
+
+    size_t used = 0;
+    for (int i = 0; i < CHECK_NAMES - 1; i++)
+        used += snprintf(log + used, size - used, "cmd%d : 0.00100 sec\n", i);
+    used += snprintf(log + used, size - used, "cmd0 : 0.00100 sec\n");
+    snprintf(log + used, size - used, "cmd%d : 0.00100 sec\n", CHECK_NAMES - 1);
+    return log;
+}
@@ -0,0 +1,43 @@
+// Log-linear latency histogram buckets shared by ex3 (prompt and stats builtin) and ex3-stats.
+//
+// Durations in ns below 2^EX3_HIST_SUB_BITS get a bucket each; above that every power of two is
+// split into EX3_HIST_HALF_COUNT equal buckets, so a bucket's midpoint is within 1% of any value in
+// it. Values from 2^EX3_HIST_MAX_BITS ns (about 4.9 hours) on share the last bucket. Callers keep
+// their own count arrays of EX3_HIST_BUCKETS entries; adding a value is one increment.
+
+#ifndef EX3_HISTOGRAM_H
+#define EX3_HISTOGRAM_H
+
+#include <stdint.h>
+
+#define EX3_HIST_SUB_BITS 7
+#define EX3_HIST_SUB_COUNT (1 << EX3_HIST_SUB_BITS)
+#define EX3_HIST_HALF_COUNT (EX3_HIST_SUB_COUNT / 2)
+#define EX3_HIST_MAX_BITS 44
+#define EX3_HIST_BUCKETS (EX3_HIST_SUB_COUNT + (EX3_HIST_MAX_BITS - EX3_HIST_SUB_BITS) * EX3_HIST_HALF_COUNT)
+
+static inline int ex3_hist_bucket(uint64_t value_ns)
+{
+    if (value_ns < EX3_HIST_SUB_COUNT)
+        return (int)value_ns;
+
+    int msb = 63 - __builtin_clzll(value_ns);
+    if (msb >= EX3_HIST_MAX_BITS)
+        return EX3_HIST_BUCKETS - 1;
+
+    int shift = msb - EX3_HIST_SUB_BITS + 1;
+    return EX3_HIST_SUB_COUNT + (shift - 1) * EX3_HIST_HALF_COUNT + (int)((value_ns >> shift) - EX3_HIST_HALF_COUNT);
+}
+
+// The middle of a bucket's range in ns
+static inline uint64_t ex3_hist_value(int bucket)
+{
+    if (bucket < EX3_HIST_SUB_COUNT)
+        return bucket;
+
+    int shift = (bucket - EX3_HIST_SUB_COUNT) / EX3_HIST_HALF_COUNT + 1;
+    uint64_t mantissa = (bucket - EX3_HIST_SUB_COUNT) % EX3_HIST_HALF_COUNT + EX3_HIST_HALF_COUNT;
+    return (mantissa << shift) + (1ULL << (shift - 1));
+}
+
+#endif
@@ -0,0 +1,55 @@
+// Binary exec_times log shared by ex3 (--binlog=<path>) and ex3-stats.
+//
+// <path> starts with an ex3_binlog_header followed by fixed-size ex3_binlog_records, appended
+// one per finished command. Commands are interned: a record only holds a 64-bit id (FNV-1a of
+// the command text) and "<path>.names" maps ids back to text, one "<id in hex>\t<command>" line
+// per id. Several shells may append to the same pair of files, an id may then appear twice in
+// .names with the same text. When ex3 rotates exec_times it renames <path> to <path>.<yyyymmdd-hhmmss.usec>
+// too and puts a new <path> with its header in place; .names covers every segment.
+
+#ifndef EX3_LOG_H
+#define EX3_LOG_H
+
+#include <stdint.h>
+
+#define EX3_BINLOG_MAGIC 0x31474f4c42335845ULL // "EX3BLOG1" little endian
+#define EX3_BINLOG_VERSION 1
+#define EX3_BINLOG_NAMES_SUFFIX ".names"
+
+// flags of a record
+#define EX3_BINLOG_IN_SHELL 1 // ran inside the shell (builtin or builtin stage), no child rusage
+#define EX3_BINLOG_FAILED 2 // non-zero exit or killed by a signal
+
+struct ex3_binlog_header
+{
+    uint64_t magic;
+    uint32_t version;
+    uint32_t record_size; // sizeof(struct ex3_binlog_record) of the writer
+};
+
+struct ex3_binlog_record
+{
+    uint64_t timestamp_ns; // when the command finished, CLOCK_REALTIME
+    uint64_t duration_ns;
+    uint64_t command_id;
+    uint64_t user_us;
+    uint64_t sys_us;
+    int64_t maxrss_kb;
+    int32_t status; // wait(2) status, 0 for builtins
+    uint32_t flags;
+    uint64_t reserved;
+};
+
+// FNV-1a, the interned id of a command text
+static inline uint64_t ex3_command_id(const char* command)
+{
+    uint64_t hash = 14695981039346656037ULL;
+    for (const unsigned char* p = (const unsigned char*)command; *p != '\0'; p++)
+    {
+        hash ^= *p;
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+#endif
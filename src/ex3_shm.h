@@ -0,0 +1,54 @@
+// Live counters a running ex3 publishes for ex3-top.
+//
+// Every shell maps a POSIX shared memory object named "/ex3-<pid>" (so /dev/shm/ex3-<pid>) holding
+// one struct ex3_shm_stats and updates it in place: no system calls, only stores. The shell is the
+// only writer and uses a seqlock: seq is odd while it writes, a reader copies the struct and
+// retries until seq was even and unchanged around the copy.
+
+#ifndef EX3_SHM_H
+#define EX3_SHM_H
+
+#include <stdint.h>
+#include <stdatomic.h>
+
+#define EX3_SHM_PREFIX "ex3-" // followed by the shell's pid
+#define EX3_SHM_MAGIC 0x00314d4853335845ULL // "EX3SHM1" little endian
+#define EX3_SHM_VERSION 1
+#define EX3_SHM_MAX_JOBS 16 // background jobs listed, bg_count has the real number
+#define EX3_SHM_COMMAND_SIZE 128 // longer command lines are cut
+
+struct ex3_shm_job
+{
+    int32_t pid;
+    uint32_t reserved;
+    uint64_t start_us; // CLOCK_REALTIME
+    char command[EX3_SHM_COMMAND_SIZE];
+};
+
+struct ex3_shm_stats
+{
+    uint64_t magic;
+    uint32_t version;
+    uint32_t size; // sizeof(struct ex3_shm_stats) of the writer
+    _Atomic uint64_t seq;
+    int32_t pid;
+    int32_t cmd;
+    int32_t dangerous_cmd_blocked;
+    int32_t dangerous_cmd_warning;
+    uint64_t started_us; // when the shell started, CLOCK_REALTIME
+    uint64_t updated_us;
+    double last_cmd_time;
+    double avg_time;
+    double min_time;
+    double max_time;
+    double p50;
+    double p95;
+    double p99;
+    uint64_t command_start_us; // 0 while the shell waits for input
+    char command[EX3_SHM_COMMAND_SIZE];
+    int32_t bg_count;
+    uint32_t reserved;
+    struct ex3_shm_job jobs[EX3_SHM_MAX_JOBS];
+};
+
+#endif
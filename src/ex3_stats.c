@@ -0,0 +1,394 @@
+// Offline queries over the binary exec_times log written by ex3 --binlog=<path>.
+//
+//   ex3-stats <binlog> [--by-name] [--top=N]
+//
+// Prints, per command, the number of runs and failures, mean and p50/p90/p99/p99.9/max duration
+// and the average user/sys time and peak memory. --by-name groups by the program name (first word)
+// instead of the whole command line. The segments ex3 rotated the log into (<binlog>.<UTC time>, kept
+// with exec_times) are read first, oldest first, then the log itself. Each file is mmap'ed and read in
+// one sequential pass; durations go into log-linear histograms (ex3_histogram.h, within 1%), so memory
+// does not grow with the number of records.
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <glob.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "ex3_log.h"
+#include "ex3_histogram.h"
+
+#define MAX_SIZE 1025
+
+struct group
+{
+    char name[MAX_SIZE];
+    unsigned long long count;
+    unsigned long long failures;
+    unsigned long long in_shell;
+    double total_ns;
+    unsigned long long max_ns;
+    unsigned long long user_us;
+    unsigned long long sys_us;
+    long long maxrss_kb;
+    unsigned long long* histogram;
+};
+
+// open addressing map from a 64-bit key to an int, grows at half full
+struct id_map
+{
+    unsigned long long* keys;
+    int* values;
+    size_t capacity;
+    size_t used;
+};
+
+struct group* groups = NULL;
+int group_count = 0;
+int group_capacity = 0;
+
+// ids of the .names file, and the group every command id (and, --by-name, every program name) went to
+struct id_map names;
+char** name_list = NULL;
+struct id_map id_groups;
+struct id_map group_keys;
+int by_name = 0;
+size_t record_count = 0;
+
+int map_init(struct id_map* map, size_t capacity);
+int* map_find(struct id_map* map, unsigned long long key, int create);
+unsigned long long percentile(const struct group* group, double fraction);
+int load_names(const char* path, struct id_map* names, char*** name_list);
+int find_group(struct id_map* keys, unsigned long long key, const char* name);
+int read_binlog(const char* path);
+int compare_groups(const void* a, const void* b);
+
+int main(int argc, char* argv[])
+{
+    int top = 0;
+    const char* path = NULL;
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--by-name") == 0)
+            by_name = 1;
+        else if (strncmp(argv[i], "--top=", 6) == 0)
+            top = atoi(argv[i] + 6);
+        else if (path == NULL && argv[i][0] != '-')
+            path = argv[i];
+        else
+        {
+            fprintf(stderr, "usage: %s <binlog> [--by-name] [--top=N]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (path == NULL)
+    {
+        fprintf(stderr, "usage: %s <binlog> [--by-name] [--top=N]\n", argv[0]);
+        return 1;
+    }
+
+    char names_path[PATH_MAX];
+    snprintf(names_path, sizeof(names_path), "%s%s", path, EX3_BINLOG_NAMES_SUFFIX);
+    if (map_init(&names, 1024) == -1 || load_names(names_path, &names, &name_list) == -1)
+        return 1;
+
+    // command id -> group, resolved once per distinct id
+    if (map_init(&id_groups, 1024) == -1 || map_init(&group_keys, 1024) == -1)
+        return 1;
+
+    // rotated segments sort by their time, "<path>.<pid>.tmp" is one being put in place
+    char pattern[PATH_MAX + 16];
+    glob_t segments;
+    snprintf(pattern, sizeof(pattern), "%s.[0-9]*", path);
+    if (glob(pattern, 0, NULL, &segments) == 0)
+    {
+        for (size_t i = 0; i < segments.gl_pathc; i++)
+        {
+            size_t len = strlen(segments.gl_pathv[i]);
+            if (len > 4 && strcmp(segments.gl_pathv[i] + len - 4, ".tmp") == 0)
+                continue;
+            if (read_binlog(segments.gl_pathv[i]) == -1)
+                return 1;
+        }
+        globfree(&segments);
+    }
+    if (read_binlog(path) == -1)
+        return 1;
+
+    qsort(groups, group_count, sizeof(struct group), compare_groups);
+
+    printf("%zu records, %d commands\n", record_count, group_count);
+    printf("%-32s %10s %7s %10s %10s %10s %10s %10s %10s %10s %10s %8s\n", "command", "count", "failed",
+           "mean", "p50", "p90", "p99", "p99.9", "max", "user", "sys", "maxrss");
+
+    for (int i = 0; i < group_count && (top <= 0 || i < top); i++)
+    {
+        const struct group* group = &groups[i];
+        unsigned long long children = group->count - group->in_shell; // only children have rusage
+
+        printf("%-32.32s %10llu %7llu %10.5f %10.5f %10.5f %10.5f %10.5f %10.5f %10.5f %10.5f %7lldK\n",
+               group->name, group->count, group->failures,
+               group->total_ns / group->count / 1e9,
+               percentile(group, 0.50) / 1e9, percentile(group, 0.90) / 1e9,
+               percentile(group, 0.99) / 1e9, percentile(group, 0.999) / 1e9,
+               group->max_ns / 1e9,
+               children ? group->user_us / (double)children / 1e6 : 0.0,
+               children ? group->sys_us / (double)children / 1e6 : 0.0,
+               group->maxrss_kb);
+    }
+
+    return 0;
+}
+
+int map_init(struct id_map* map, size_t capacity)
+{
+    map->keys = calloc(capacity, sizeof(*map->keys));
+    map->values = malloc(capacity * sizeof(*map->values));
+    if (map->keys == NULL || map->values == NULL)
+    {
+        perror("malloc");
+        return -1;
+    }
+    map->capacity = capacity;
+    map->used = 0;
+    return 0;
+}
+
+// Returns the value slot of key, with create a missing key is added with value -1.
+// Key 0 is stored as 1, ids are hashes so that only merges two unlikely commands.
+int* map_find(struct id_map* map, unsigned long long key, int create)
+{
+    if (key == 0)
+        key = 1;
+
+    if (create && (map->used + 1) * 2 > map->capacity)
+    {
+        struct id_map bigger;
+        if (map_init(&bigger, map->capacity * 2) == -1)
+            return NULL;
+        for (size_t i = 0; i < map->capacity; i++)
+        {
+            if (map->keys[i] != 0)
+                *map_find(&bigger, map->keys[i], 1) = map->values[i];
+        }
+        free(map->keys);
+        free(map->values);
+        *map = bigger;
+    }
+
+    size_t slot = (key ^ (key >> 29)) & (map->capacity - 1);
+    while (map->keys[slot] != 0)
+    {
+        if (map->keys[slot] == key)
+            return &map->values[slot];
+        slot = (slot + 1) & (map->capacity - 1);
+    }
+
+    if (!create)
+        return NULL;
+    map->keys[slot] = key;
+    map->values[slot] = -1;
+    map->used++;
+    return &map->values[slot];
+}
+
+unsigned long long percentile(const struct group* group, double fraction)
+{
+    unsigned long long rank = (unsigned long long)(fraction * group->count + 0.999999);
+    unsigned long long seen = 0;
+
+    if (rank == 0)
+        rank = 1;
+    for (int i = 0; i < EX3_HIST_BUCKETS; i++)
+    {
+        seen += group->histogram[i];
+        if (seen >= rank)
+        {
+            unsigned long long value = ex3_hist_value(i);
+            return value < group->max_ns ? value : group->max_ns;
+        }
+    }
+    return group->max_ns;
+}
+
+// Reads "<id in hex>\t<command>" lines into names (id -> index into *name_list)
+int load_names(const char* path, struct id_map* names, char*** name_list)
+{
+    FILE* file = fopen(path, "r");
+    if (file == NULL)
+        return 0; // every command shows up as its id
+
+    char line[MAX_SIZE * 2];
+    int count = 0, capacity = 0;
+    while (fgets(line, sizeof(line), file) != NULL)
+    {
+        char* tab = strchr(line, '\t');
+        if (tab == NULL)
+            continue;
+        *tab = '\0';
+        tab[1 + strcspn(tab + 1, "\n")] = '\0';
+
+        int* slot = map_find(names, strtoull(line, NULL, 16), 1);
+        if (slot == NULL)
+            return -1;
+        if (*slot != -1)
+            continue; // written again by another shell
+
+        if (count == capacity)
+        {
+            capacity = capacity ? capacity * 2 : 256;
+            char** bigger = realloc(*name_list, capacity * sizeof(char*));
+            if (bigger == NULL)
+            {
+                perror("realloc");
+                return -1;
+            }
+            *name_list = bigger;
+        }
+        (*name_list)[count] = strdup(tab + 1);
+        *slot = count++;
+    }
+
+    fclose(file);
+    return 0;
+}
+
+// Index of the group with key, created with name if it is new. -1 if out of memory.
+int find_group(struct id_map* keys, unsigned long long key, const char* name)
+{
+    int* slot = map_find(keys, key, 1);
+    if (slot == NULL)
+        return -1;
+    if (*slot != -1)
+        return *slot;
+
+    if (group_count == group_capacity)
+    {
+        group_capacity = group_capacity ? group_capacity * 2 : 64;
+        struct group* bigger = realloc(groups, group_capacity * sizeof(struct group));
+        if (bigger == NULL)
+        {
+            perror("realloc");
+            return -1;
+        }
+        groups = bigger;
+    }
+
+    struct group* group = &groups[group_count];
+    memset(group, 0, sizeof(*group));
+    snprintf(group->name, sizeof(group->name), "%s", name);
+    group->histogram = calloc(EX3_HIST_BUCKETS, sizeof(unsigned long long));
+    if (group->histogram == NULL)
+    {
+        perror("calloc");
+        return -1;
+    }
+
+    *slot = group_count;
+    return group_count++;
+}
+
+// Most frequent commands first
+int compare_groups(const void* a, const void* b)
+{
+    const struct group* left = a;
+    const struct group* right = b;
+    if (left->count != right->count)
+        return left->count < right->count ? 1 : -1;
+    return strcmp(left->name, right->name);
+}
+
+// Adds the records of one binary log file to the groups. -1 (after a message) if it can't be read.
+int read_binlog(const char* path)
+{
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd == -1 || fstat(fd, &st) == -1)
+    {
+        perror(path);
+        if (fd != -1)
+            close(fd);
+        return -1;
+    }
+    if ((size_t)st.st_size < sizeof(struct ex3_binlog_header))
+    {
+        fprintf(stderr, "%s: not an ex3 binary log\n", path);
+        close(fd);
+        return -1;
+    }
+
+    const char* data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED)
+    {
+        perror("mmap");
+        close(fd);
+        return -1;
+    }
+    madvise((void*)data, st.st_size, MADV_SEQUENTIAL);
+    close(fd);
+
+    const struct ex3_binlog_header* header = (const struct ex3_binlog_header*)data;
+    if (header->magic != EX3_BINLOG_MAGIC || header->version != EX3_BINLOG_VERSION || header->record_size != sizeof(struct ex3_binlog_record))
+    {
+        fprintf(stderr, "%s: not an ex3 binary log of this version\n", path);
+        munmap((void*)data, st.st_size);
+        return -1;
+    }
+
+    // a record still being appended at the end is left out
+    size_t count = (st.st_size - sizeof(*header)) / sizeof(struct ex3_binlog_record);
+    const struct ex3_binlog_record* records = (const struct ex3_binlog_record*)(data + sizeof(*header));
+
+    for (size_t r = 0; r < count; r++)
+    {
+        const struct ex3_binlog_record* record = &records[r];
+        int* slot = map_find(&id_groups, record->command_id, 1);
+        if (slot == NULL)
+            return -1;
+
+        if (*slot == -1)
+        {
+            char name[MAX_SIZE];
+            int* name_index = map_find(&names, record->command_id, 0);
+            if (name_index != NULL)
+                snprintf(name, sizeof(name), "%s", name_list[*name_index]);
+            else
+                snprintf(name, sizeof(name), "<%016llx>", (unsigned long long)record->command_id);
+
+            unsigned long long key = record->command_id;
+            if (by_name)
+            {
+                name[strcspn(name, " ")] = '\0';
+                key = ex3_command_id(name);
+            }
+
+            *slot = find_group(&group_keys, key, name);
+            if (*slot == -1)
+                return -1;
+        }
+
+        struct group* group = &groups[*slot];
+        group->count++;
+        group->total_ns += record->duration_ns;
+        if (record->duration_ns > group->max_ns)
+            group->max_ns = record->duration_ns;
+        group->histogram[ex3_hist_bucket(record->duration_ns)]++;
+        if (record->flags & EX3_BINLOG_FAILED)
+            group->failures++;
+        if (record->flags & EX3_BINLOG_IN_SHELL)
+            group->in_shell++;
+        group->user_us += record->user_us;
+        group->sys_us += record->sys_us;
+        if (record->maxrss_kb > group->maxrss_kb)
+            group->maxrss_kb = record->maxrss_kb;
+    }
+
+    record_count += count;
+    munmap((void*)data, st.st_size);
+    return 0;
+}
@@ -0,0 +1,155 @@
+// Live view of every ex3 running on this host, from the counters they publish in /dev/shm.
+//
+//   ex3-top [--watch=SEC] [--jobs]
+//
+// Prints one line per shell (commands run, dangerous commands blocked and warned about, timing,
+// background jobs and what it runs right now) and a total line. --watch repeats every SEC seconds,
+// --jobs also lists each shell's background jobs. Shells are never stopped or slowed down: the
+// counters are copied under their seqlock, see ex3_shm.h.
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <errno.h>
+#include <signal.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+#include "ex3_shm.h"
+
+#define SHM_DIR "/dev/shm"
+#define READ_RETRIES 1000 // a shell that keeps seq odd this long is stuck half way, skip it
+
+int read_shell(const char* name, struct ex3_shm_stats* copy);
+void print_shells(int show_jobs);
+unsigned long long now_us(void);
+
+int main(int argc, char* argv[])
+{
+    double watch = 0;
+    int show_jobs = 0;
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (strncmp(argv[i], "--watch=", 8) == 0 && atof(argv[i] + 8) > 0)
+            watch = atof(argv[i] + 8);
+        else if (strcmp(argv[i], "--jobs") == 0)
+            show_jobs = 1;
+        else
+        {
+            fprintf(stderr, "usage: %s [--watch=SEC] [--jobs]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    while (1)
+    {
+        if (watch > 0)
+            printf("\033[H\033[J"); // clear the terminal
+        print_shells(show_jobs);
+        fflush(stdout);
+        if (watch <= 0)
+            return 0;
+        usleep((useconds_t)(watch * 1000000));
+    }
+}
+
+// Copies the counters of /dev/shm/<name>; -1 if it is not a live ex3 of this version
+int read_shell(const char* name, struct ex3_shm_stats* copy)
+{
+    char path[512];
+    snprintf(path, sizeof(path), "%s/%s", SHM_DIR, name);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+        return -1;
+
+    const struct ex3_shm_stats* shared = mmap(NULL, sizeof(*shared), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (shared == MAP_FAILED)
+        return -1;
+
+    int ok = 0;
+    for (int attempt = 0; attempt < READ_RETRIES && !ok; attempt++)
+    {
+        uint64_t before = atomic_load_explicit((_Atomic uint64_t*)&shared->seq, memory_order_acquire);
+        if (before & 1)
+        {
+            sched_yield();
+            continue;
+        }
+        memcpy(copy, (const void*)shared, sizeof(*copy));
+        atomic_thread_fence(memory_order_acquire); // the copy is done before seq is read again
+        ok = atomic_load_explicit((_Atomic uint64_t*)&shared->seq, memory_order_relaxed) == before;
+    }
+    munmap((void*)shared, sizeof(*shared));
+
+    if (!ok || copy->magic != EX3_SHM_MAGIC || copy->version != EX3_SHM_VERSION || copy->size != sizeof(*copy))
+        return -1;
+
+    // a shell killed with SIGKILL leaves its segment behind
+    if (kill(copy->pid, 0) == -1 && errno == ESRCH)
+        return -1;
+    return 0;
+}
+
+void print_shells(int show_jobs)
+{
+    DIR* dir = opendir(SHM_DIR);
+    if (dir == NULL)
+    {
+        perror(SHM_DIR);
+        return;
+    }
+
+    unsigned long long now = now_us();
+    int shells = 0, total_cmd = 0, total_blocked = 0, total_warned = 0, total_jobs = 0, busy = 0;
+    double total_time = 0;
+
+    printf("%8s %8s %7s %6s %10s %10s %10s %10s %10s %5s  %s\n", "pid", "cmd", "blocked", "warned",
+           "last", "avg", "p50", "p99", "max", "jobs", "running");
+
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != NULL)
+    {
+        struct ex3_shm_stats stats;
+        if (strncmp(entry->d_name, EX3_SHM_PREFIX, strlen(EX3_SHM_PREFIX)) != 0 || read_shell(entry->d_name, &stats) == -1)
+            continue;
+
+        char running[EX3_SHM_COMMAND_SIZE + 32] = "-";
+        if (stats.command_start_us != 0)
+        {
+            snprintf(running, sizeof(running), "%.1fs %s", (now - stats.command_start_us) / 1e6, stats.command);
+            busy++;
+        }
+
+        printf("%8d %8d %7d %6d %10.5f %10.5f %10.5f %10.5f %10.5f %5d  %s\n", stats.pid, stats.cmd,
+               stats.dangerous_cmd_blocked, stats.dangerous_cmd_warning, stats.last_cmd_time, stats.avg_time,
+               stats.p50, stats.p99, stats.max_time, stats.bg_count, running);
+
+        for (int i = 0; show_jobs && i < stats.bg_count && i < EX3_SHM_MAX_JOBS; i++)
+            printf("%8s [%d] %d %.1fs %s\n", "", i + 1, stats.jobs[i].pid,
+                   (now - stats.jobs[i].start_us) / 1e6, stats.jobs[i].command);
+
+        shells++;
+        total_cmd += stats.cmd;
+        total_blocked += stats.dangerous_cmd_blocked;
+        total_warned += stats.dangerous_cmd_warning;
+        total_jobs += stats.bg_count;
+        total_time += stats.avg_time * stats.cmd;
+    }
+    closedir(dir);
+
+    printf("%d shells, %d busy: %d commands, %d blocked, %d warned, avg %.5f sec, %d background jobs\n",
+           shells, busy, total_cmd, total_blocked, total_warned, total_cmd ? total_time / total_cmd : 0.0, total_jobs);
+}
+
+unsigned long long now_us(void)
+{
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    return now.tv_sec * 1000000ULL + now.tv_usec;
+}